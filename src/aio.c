@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "aio.h"
+#include "util.h"
+
+#define POOL_THREADS 4
+
+/* Whole file reads and writes, overlapped with the caller's work. io_uring is
+ * used where the kernel allows it (5.6 or later, and not blocked by seccomp);
+ * otherwise a small pool of threads does blocking reads and writes. Opening a
+ * file is always done by the caller, as it's cheap next to moving the data */
+struct Aio {
+    bool      uring;
+    unsigned  depth;
+#ifdef HAVE_IO_URING
+    int       ringfd;
+    unsigned  *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned  *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void      *sqring, *cqring;
+    size_t    sqringsize, cqringsize, sqessize;
+#endif
+    /* thread pool */
+    pthread_t       threads[POOL_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t  queued;   /* signaled when a request is queued */
+    pthread_cond_t  finished; /* broadcast when a request is finished */
+    Aioreq          *head, *tail;
+    bool            stop;
+};
+
+static void finish(Aioreq *r);
+static void submit(Aio *a, Aioreq *r);
+static void *worker(void *arg);
+#ifdef HAVE_IO_URING
+static bool uringinit(Aio *a);
+static void uringfree(Aio *a);
+static void uringsubmit(Aio *a, Aioreq *r);
+static void uringreap(Aio *a);
+#endif
+
+#ifdef HAVE_IO_URING
+bool
+uringinit(Aio *a) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    a->ringfd = syscall(__NR_io_uring_setup, a->depth, &p);
+    if (a->ringfd < 0)
+        return false;
+    /* IORING_OP_READ and IORING_OP_WRITE came along with this one */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(a->ringfd);
+        return false;
+    }
+
+    a->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (a->cqringsize > a->sqringsize)
+            a->sqringsize = a->cqringsize;
+        a->cqringsize = a->sqringsize;
+    }
+    a->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    a->sqring = mmap(NULL, a->sqringsize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, a->ringfd, IORING_OFF_SQ_RING);
+    if (a->sqring == MAP_FAILED)
+        die("aio: couldn't map the submission ring\n");
+    a->cqring = a->sqring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        a->cqring = mmap(NULL, a->cqringsize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, a->ringfd, IORING_OFF_CQ_RING);
+        if (a->cqring == MAP_FAILED)
+            die("aio: couldn't map the completion ring\n");
+    }
+    a->sqes = mmap(NULL, a->sqessize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, a->ringfd, IORING_OFF_SQES);
+    if (a->sqes == MAP_FAILED)
+        die("aio: couldn't map the submission queue entries\n");
+
+    a->sqhead  = (unsigned *) ((char *) a->sqring + p.sq_off.head);
+    a->sqtail  = (unsigned *) ((char *) a->sqring + p.sq_off.tail);
+    a->sqmask  = (unsigned *) ((char *) a->sqring + p.sq_off.ring_mask);
+    a->sqarray = (unsigned *) ((char *) a->sqring + p.sq_off.array);
+    a->cqhead  = (unsigned *) ((char *) a->cqring + p.cq_off.head);
+    a->cqtail  = (unsigned *) ((char *) a->cqring + p.cq_off.tail);
+    a->cqmask  = (unsigned *) ((char *) a->cqring + p.cq_off.ring_mask);
+    a->cqes    = (struct io_uring_cqe *) ((char *) a->cqring + p.cq_off.cqes);
+
+    return true;
+}
+
+void
+uringfree(Aio *a) {
+    munmap(a->sqes, a->sqessize);
+    if (a->cqring != a->sqring)
+        munmap(a->cqring, a->cqringsize);
+    munmap(a->sqring, a->sqringsize);
+    close(a->ringfd);
+}
+
+/* queues the transfer of whatever is left of r */
+void
+uringsubmit(Aio *a, Aioreq *r) {
+    unsigned tail = *a->sqtail;
+    unsigned idx  = tail & *a->sqmask;
+    struct io_uring_sqe *sqe = &a->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = r->fd;
+    sqe->addr      = (uintptr_t) (r->buf + r->done);
+    sqe->len       = r->size - r->done;
+    sqe->off       = r->done;
+    sqe->user_data = (uintptr_t) r;
+    a->sqarray[idx] = idx;
+    __atomic_store_n(a->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, a->ringfd, 1, 0, 0, NULL, 0) < 0)
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            die("aio: io_uring_enter: %s\n", strerror(errno));
+}
+
+/* waits for at least one completion, and handles all there are */
+void
+uringreap(Aio *a) {
+    unsigned head = *a->cqhead;
+
+    while (syscall(__NR_io_uring_enter, a->ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        if (errno != EINTR)
+            die("aio: io_uring_enter: %s\n", strerror(errno));
+
+    while (head != __atomic_load_n(a->cqtail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &a->cqes[head & *a->cqmask];
+        Aioreq *r = (Aioreq *) (uintptr_t) cqe->user_data;
+        int res   = cqe->res;
+
+        __atomic_store_n(a->cqhead, ++head, __ATOMIC_RELEASE);
+        if (res == -EINTR || res == -EAGAIN) {
+            uringsubmit(a, r);
+            continue;
+        }
+        if (res <= 0)
+            die("aio: error %s %s\n", r->write ? "writing" : "reading", r->filename);
+        r->done += res;
+        if (r->done < r->size)
+            uringsubmit(a, r); /* short transfer */
+        else
+            finish(r);
+    }
+}
+#endif
+
+/* Runs blocking transfers for the thread pool */
+void *
+worker(void *arg) {
+    Aio *a = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&a->lock);
+        while (!a->head && !a->stop)
+            pthread_cond_wait(&a->queued, &a->lock);
+        if (!a->head) {
+            pthread_mutex_unlock(&a->lock);
+            return NULL;
+        }
+        Aioreq *r = a->head;
+        if (!(a->head = r->next))
+            a->tail = NULL;
+        pthread_mutex_unlock(&a->lock);
+
+        bool ok = r->write ? writeall(r->fd, r->buf, r->size) : readall(r->fd, r->buf, r->size);
+        if (!ok)
+            die("aio: error %s %s\n", r->write ? "writing" : "reading", r->filename);
+        r->done = r->size;
+
+        pthread_mutex_lock(&a->lock);
+        finish(r);
+        pthread_cond_broadcast(&a->finished);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void
+finish(Aioreq *r) {
+    if (close(r->fd))
+        die("aio: error closing %s\n", r->filename);
+    if (r->target) {
+        xrename(r->filename, r->target);
+        free(r->target);
+        r->target = NULL;
+    }
+    free(r->filename);
+    r->filename = NULL;
+    r->finished = true;
+}
+
+void
+submit(Aio *a, Aioreq *r) {
+    r->filename = xstrdup(r->filename);
+    r->finished = false;
+    r->done     = 0;
+    r->next     = NULL;
+
+#ifdef HAVE_IO_URING
+    if (a->uring) {
+        uringsubmit(a, r);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&a->lock);
+    if (a->tail)
+        a->tail->next = r;
+    else
+        a->head = r;
+    a->tail = r;
+    pthread_cond_signal(&a->queued);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* depth bounds the amount of requests the caller keeps in flight */
+Aio *
+aioinit(unsigned depth) {
+    Aio *a = xmalloc(sizeof(*a));
+
+    memset(a, 0, sizeof(*a));
+    a->depth = depth;
+#ifdef HAVE_IO_URING
+    if ((a->uring = uringinit(a)))
+        return a;
+#endif
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->queued, NULL);
+    pthread_cond_init(&a->finished, NULL);
+    for (size_t i = 0; i < POOL_THREADS; i++)
+        if (pthread_create(&a->threads[i], NULL, worker, a))
+            die("aio: couldn't create thread\n");
+
+    return a;
+}
+
+/* every request must have been waited for */
+void
+aiofree(Aio *a) {
+#ifdef HAVE_IO_URING
+    if (a->uring) {
+        uringfree(a);
+        free(a);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&a->lock);
+    a->stop = true;
+    pthread_cond_broadcast(&a->queued);
+    pthread_mutex_unlock(&a->lock);
+    for (size_t i = 0; i < POOL_THREADS; i++)
+        pthread_join(a->threads[i], NULL);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->queued);
+    pthread_cond_destroy(&a->finished);
+    free(a);
+}
+
+const char *
+aioengine(const Aio *a) {
+    return a->uring ? "io_uring" : "threads";
+}
+
+/* starts reading the whole of filename into a newly allocated r->buf */
+void
+aioread(Aio *a, Aioreq *r, const char *filename) {
+    struct stat st;
+
+    if ((r->fd = open(filename, O_RDONLY)) < 0)
+        die("open: couldn't open %s\n", filename);
+    if (fstat(r->fd, &st))
+        die("fstat: error on %s\n", filename);
+    if (st.st_size <= 0)
+        die("%s: empty file\n", filename);
+
+    r->write    = false;
+    r->size     = st.st_size;
+    r->buf      = xpixelalloc(r->size, 0);
+    r->filename = (char *) filename;
+    r->target   = NULL;
+    submit(a, r);
+}
+
+/* starts writing size bytes of buf to a temporary file, which replaces
+ * filename once complete */
+void
+aiowrite(Aio *a, Aioreq *r, const char *filename, uint8_t *buf, size_t size) {
+    char tmpname[PATH_MAX];
+
+    if ((r->fd = opentemp(filename, tmpname, sizeof(tmpname), 0)) < 0)
+        die("open: couldn't create a file next to %s\n", filename);
+
+    r->write    = true;
+    r->size     = size;
+    r->buf      = buf;
+    r->filename = tmpname;
+    r->target   = xstrdup(filename);
+    submit(a, r);
+}
+
+void
+aiowait(Aio *a, Aioreq *r) {
+#ifdef HAVE_IO_URING
+    if (a->uring) {
+        while (!r->finished)
+            uringreap(a);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&a->lock);
+    while (!r->finished)
+        pthread_cond_wait(&a->finished, &a->lock);
+    pthread_mutex_unlock(&a->lock);
+}
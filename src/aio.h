@@ -0,0 +1,22 @@
+typedef struct Aio Aio;
+
+/* a whole file read or write in flight. Reads allocate buf with
+ * xpixelalloc(), and it's then owned by the caller; writes never free it */
+typedef struct Aioreq {
+    struct Aioreq *next;     /* queue link, used by the thread pool */
+    char          *filename; /* file being read or written */
+    char          *target;   /* what a write is renamed to once done */
+    int           fd;
+    bool          write;
+    bool          finished;
+    uint8_t       *buf;
+    size_t        size;      /* bytes to transfer */
+    size_t        done;      /* bytes transferred so far */
+} Aioreq;
+
+Aio        *aioinit(unsigned depth);
+void       aiofree(Aio *a);
+const char *aioengine(const Aio *a);
+void       aioread(Aio *a, Aioreq *r, const char *filename);
+void       aiowrite(Aio *a, Aioreq *r, const char *filename, uint8_t *buf, size_t size);
+void       aiowait(Aio *a, Aioreq *r);
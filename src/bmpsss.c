@@ -1,21 +1,46 @@
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <tgmath.h>
-
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "pack.h"
+#include "queue.h"
+#include "serve.h"
 #include "util.h"
 
 #define BMP_HEADER_SIZE      14
+#define CORE_HEADER_SIZE     12
 #define DIB_HEADER_SIZE      40
 #define PALETTE_SIZE         1024
 #define PIXEL_ARRAY_OFFSET   (BMP_HEADER_SIZE + DIB_HEADER_SIZE + PALETTE_SIZE)
-#define UNUSED2_OFFSET       8
-#define WIDTH_OFFSET         18
-#define HEIGHT_OFFSET        22
+#define BI_RGB               0
+#define BI_BITFIELDS         3
+#define SHD_HEADER_SIZE      32
+#define SHD_VERSION          1
+#define DIRECT_ALIGN         4096
+#define IO_DEPTH             8
+#define IO_AHEAD             (IO_DEPTH / 2) /* reads, or writes, kept in flight */
+#define TILE_PIXELS          16384
+#define PACK_HEADER          5   /* method and length of a packed secret */
+#define PACK_STORED          0
+#define PACK_DELTA           1
+#define PREVIEW_SIZE         128 /* longest side of --preview images */
+#define VERIFY_SAMPLES       64  /* blocks checked by --verify */
+#define QUEUE_FRAMES         4   /* --sequence frames formed but not hidden yet */
+#define INDEX_DIRS           64  /* directories --serve keeps the index of */
 #define BITS_PER_PIXEL       8
 #define PRIME                251
 #define DEFAULT_SEED         691
@@ -31,9 +56,10 @@ typedef struct {
     uint32_t offset;  /* starting address of the pixel array (bitmap data) */
 } BMPheader;
 
-/* 40 bytes BITMAPINFOHEADER */
+/* 40 bytes BITMAPINFOHEADER. Longer headers (V4, V5) start with the same
+ * fields, and the 12 bytes OS/2 BITMAPCOREHEADER is widened into it */
 typedef struct {
-    uint32_t size;           /* the size of this header (40 bytes) */
+    uint32_t size;           /* the size of this header (usually 40 bytes) */
     uint32_t width;          /* the bitmap width in pixels */
     int32_t  height;         /* the bitmap height in pixels; can be negative */
     uint16_t nplanes;        /* number of color planes used; Must set to 1 */
@@ -49,57 +75,245 @@ typedef struct {
 typedef struct {
     BMPheader bmpheader;             /* 14 bytes BMP starting header */
     DIBheader dibheader;             /* 40 bytes DIB header */
-    uint8_t   palette[PALETTE_SIZE]; /* color palette; mandatory for depth <= 8 */
+    uint8_t   palette[PALETTE_SIZE]; /* color palette; only used when not read from a file */
     uint8_t   *imgpixels;            /* array of bytes representing each pixel */
+    uint8_t   *raw;                  /* whole file contents if read from disk, or NULL */
+    size_t    rawsize;               /* size of raw in bytes */
 } Bitmap;
 
-typedef bool (*fn)(FILE *, uint16_t, uint32_t);
+/* 32 bytes header of the compact shadow container, stored little-endian.
+ * Shadow bytes follow at offset, which is DIRECT_ALIGN for files meant to be
+ * read and written with O_DIRECT (the file is then padded to DIRECT_ALIGN) */
+typedef struct {
+    uint8_t  id[4];        /* magic number, "SHDW" */
+    uint16_t version;      /* container format version */
+    uint16_t seed;         /* key (seed) */
+    uint16_t shadownumber; /* shadow number; never 0 */
+    uint16_t k;            /* threshold the shadow was formed for */
+    uint32_t width;        /* width of the secret in pixels */
+    int32_t  height;       /* height of the secret in pixels */
+    uint32_t size;         /* bytes of shadow data */
+    uint32_t offset;       /* starting address of the shadow data */
+    uint32_t reserved;     /* must be 0 */
+} SHDheader;
+
+/* walks the bytes of a pixel array row by row, skipping row padding */
+typedef struct {
+    uint8_t   *row;     /* current row of the pixel array */
+    uint32_t  col;      /* next byte to use within row */
+    uint32_t  rowbytes; /* bytes of each row holding pixel data */
+    ptrdiff_t stride;   /* distance to the next row; negative walking upwards */
+} Cursor;
+
+/* splits the pixels of a secret into the blocks of k pixels each section
+ * polynomial is made of. A block that straddles two rows, or the last one if
+ * it is short, is gathered into scratch; any other is used in place */
+typedef struct {
+    Cursor   c;       /* position of the next pixel */
+    Cursor   start;   /* position of the first pixel of the current block */
+    uint32_t left;    /* pixels not handed out yet */
+    uint16_t k;       /* pixels per block */
+    uint16_t count;   /* pixels in the current block; less than k if last */
+    uint8_t  *scratch;
+} Blocks;
+
+/* a shadow read piecemeal, straight from its cover or container file */
+typedef struct {
+    FILE     *fp;
+    uint16_t seed;      /* key (seed) */
+    uint16_t number;    /* shadow number */
+    bool     container; /* whether fp is a container rather than a cover */
+    uint32_t offset;    /* start of the pixel array, or of the shadow data */
+    uint32_t rowbytes;  /* bytes of each cover row carrying shadow bits */
+    uint32_t stride;    /* bytes of each cover row, padding included */
+    uint8_t  *buf;      /* cover bytes of the last range read */
+    size_t   bufsize;
+} Shadowfile;
+
+/* the headers of a file, as the validity checks need them */
+typedef struct {
+    bool      bmp;       /* whether the fields below are of a usable BMP */
+    bool      container; /* whether h holds a container header */
+    uint16_t  number;    /* shadow number of the BMP */
+    uint32_t  rowbytes;  /* bytes of each row holding pixel data */
+    uint32_t  stride;    /* bytes of each row, padding included */
+    uint32_t  height;    /* amount of rows */
+    SHDheader h;
+} Fileinfo;
+
+/* a regular file of an indexed directory */
+typedef struct {
+    char     *name;
+    Fileinfo info;
+} Indexentry;
+
+/* A directory as --serve last read it: its regular files, in readdir() order.
+ * Adding, removing or renaming a file changes the mtime of a directory, so
+ * while it's the same the list still holds */
+typedef struct {
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;   /* of the directory, taken before reading it */
+    bool            settled; /* whether a change since would change mtime */
+    uint64_t        used;    /* when it was last asked for, to evict by */
+    size_t          count;
+    Indexentry      *files;
+} Dirindex;
+
+/* a frame of --sequence, passed from the threads forming its shadows to
+ * those hiding and writing them */
+typedef struct {
+    size_t   index;    /* position in the sequence, from 0 */
+    uint32_t width;    /* of the secret as shared, i.e. packed */
+    int32_t  height;
+    Bitmap   **shadows;
+} Frame;
+
+/* what the threads of a --sequence share */
+typedef struct {
+    char            **secrets;  /* frame file names, in order */
+    size_t          count;
+    size_t          next;       /* next frame to form the shadows of */
+    pthread_mutex_t lock;       /* guards next and engine */
+    Queue           *formed;    /* frames waiting to be hidden */
+    Bitmap          **covers;   /* the n covers every frame is hidden in, or NULL
+                                 * for containers */
+    uint32_t        maxpixels;  /* largest secret the covers can hold */
+    uint32_t        width;      /* of raw secrets */
+    int32_t         height;
+    int             digits;     /* of the frame numbers in directory names */
+    const char      *engine;    /* what covers are written through, if any */
+    uint16_t        k;
+    uint16_t        n;
+    uint16_t        seed;
+} Sequence;
+
+typedef bool (*fn)(const Fileinfo *, uint16_t, uint32_t);
 /* prototypes */
 static long     randint(long max);
 static void     swap(uint8_t *s, uint8_t *t);
 static int      countfiles(const char *dirname);
 static void     usage(void);
-static uint32_t get32bitsfromheader(FILE *fp, int offset);
-static uint32_t bmpfilewidth(FILE *fp);
-static uint32_t bmpfileheight(FILE *fp);
+static bool     isdirectory(const char *path);
+static bool     isvalidtemplate(const char *template);
+static void     shadowpath(char *buf, size_t size, uint16_t number, const char *ext);
 static uint32_t bmpimagesize(const Bitmap *bp);
+static uint32_t bmpstride(const Bitmap *bp);
+static uint32_t bmprowbytes(const Bitmap *bp);
+static uint32_t bmpheight(const Bitmap *bp);
+static uint32_t bmpcapacity(const Bitmap *bp);
 static void     initpalette(uint8_t palette[static PALETTE_SIZE]);
 static Bitmap   *newbitmap(uint32_t width, int32_t height, uint16_t seed);
 static void     freebitmap(Bitmap *bp);
 static Bitmap   *newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum, uint32_t pixelarraysize);
 static void     changeheaderendianness(BMPheader *h);
 static void     changedibendianness(DIBheader *h);
-static void     readbmpheader(Bitmap *bp, FILE *fp);
+static const uint8_t *getfield(void *dst, const uint8_t *src, size_t size);
+static void     readbmpheader(Bitmap *bp, const uint8_t *buf);
 static void     writebmpheader(const Bitmap *bp, FILE *fp);
-static void     readdibheader(Bitmap *bp, FILE *fp);
+static bool     readdibheader(Bitmap *bp, const uint8_t *buf, size_t len);
 static void     writedibheader(const Bitmap *bp, FILE *fp);
+static bool     parseheaders(Bitmap *bp, const uint8_t *buf, size_t len, size_t filesize);
+static bool     readheaders(Bitmap *bp, FILE *fp);
 static Bitmap   *bmpfromfile(const char *filename);
-static bool     isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize);
-static bool     kdivisiblesize(FILE *fp, uint16_t k);
+static Bitmap   *bmpfrombuffer(const char *filename, uint8_t *raw, size_t size);
+static void     putbmpheader(const Bitmap *bp, uint8_t *buf);
+static bool     hasextension(const char *filename, const char *ext);
+static size_t   parsepgm(const uint8_t *buf, size_t len, uint32_t *width, int32_t *height);
+static Bitmap   *bmpfromrows(const uint8_t *rows, uint32_t width, int32_t height);
+static Bitmap   *secretfromfile(const char *filename, uint32_t width, int32_t height);
+static void     secrettofile(const Bitmap *bp, const char *filename);
+static void     changeshdendianness(SHDheader *h);
+static uint8_t  *putfield(uint8_t *dst, const void *src, size_t size);
+static bool     readshdheader(SHDheader *h, const uint8_t *buf, size_t len, size_t filesize);
+static void     writeshdheader(const SHDheader *h, uint8_t *buf);
+static void     shadowtocontainer(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height);
+static void     writecontainer(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, const char *filename);
+static Bitmap   *containerfromfile(const char *filename);
+static bool     isvalidbmpsize(const Bitmap *bp, uint16_t k, uint32_t secretsize);
 static void     bmptofile(const Bitmap *bp, const char *filename);
 static void     findclosestpair(uint32_t x, uint32_t *width, int32_t *height);
+static uint32_t secretpixels(uint32_t width, int32_t height);
+static uint32_t shadowsize(uint32_t pixels, uint16_t k);
+static void     clearpadding(Bitmap *bp);
+static void     initblocks(Blocks *b, const Bitmap *bp, uint16_t k);
+static uint8_t  *nextblock(Blocks *b);
+static void     endblock(Blocks *b, const uint8_t *block);
+static void     freeblocks(Blocks *b);
 static Bitmap   *newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber);
 static Bitmap   **formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed);
-static void     findcoefficients(int **mat, uint16_t k);
+static uint32_t *vandermondeinverse(const uint16_t *xs, uint16_t k);
+static void     combineblock(const uint32_t *inv, const uint8_t *ys, uint16_t k, uint8_t *block);
 static Bitmap   *revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k);
-static void     hideshadow(Bitmap *bp, const Bitmap *shadow);
+static void     initcursor(Cursor *c, const Bitmap *bp);
+static void     initsecretcursor(Cursor *c, const Bitmap *bp);
+static uint8_t  *nextbyte(Cursor *c);
+static void     hidebyte(Cursor *c, uint8_t byte);
+static void     hidetile(const uint8_t *coeff, size_t count, uint16_t k, Bitmap **covers, Cursor *cursors, uint16_t n);
+static void     formandhideshadows(const Bitmap *bp, Bitmap **covers, uint16_t k, uint16_t n, uint16_t first, uint16_t seed);
+static void     hideincovers(const Bitmap *bp, char **filepaths, uint16_t k, uint16_t n, uint16_t seed);
+static Bitmap   **readcovers(char **filepaths, uint16_t n);
+static void     writecovers(Aio *aio, Bitmap **covers, uint16_t n, const char *dir);
 static Bitmap   *retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k);
-static bool     isbmp(FILE *fp);
-static bool     isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize);
-static bool     isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter);
+static Bitmap   **retrieveshadows(char **filepaths, uint32_t width, int32_t height, uint16_t k);
+static bool     isvalidshadow(const Fileinfo *fi, uint16_t k, uint32_t secretsize);
+static bool     isvalidbmp(const Fileinfo *fi, uint16_t k, uint32_t secretsize);
+static bool     isvalidcontainer(const Fileinfo *fi, uint16_t k, uint32_t secretsize);
+static void     readfileinfo(Fileinfo *fi, FILE *fp);
+static bool     hascapacity(const Fileinfo *fi, uint16_t k, uint32_t secretsize);
+static bool     getfileinfo(const char *filepath, Fileinfo *fi);
+static void     freedirindex(Dirindex *di);
+static const Dirindex *finddir(const char *dir);
+static void     indexdir(const char *dir);
+static void     lockindex(void);
+static void     unlockindex(void);
+static void     warmindex(int argc, char *argv[]);
+static int      run(int argc, char *argv[argc + 1]);
+static char     **findvalidfilenames(const char *dir, uint16_t k, size_t max, fn isvalid, uint32_t size, size_t *count);
 static char     **getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size);
 static char     **getbmpfilenames(const char *dir, uint16_t k, uint16_t n, uint32_t size);
 static char     **getshadowfilenames(const char *dir, uint16_t k, uint32_t size);
-static void     distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed);
+static char     **getcontainerfilenames(const char *dir, uint16_t k, uint32_t size);
+static void     distributeimage(const char *dir, const char *imgpath, uint32_t width, int32_t height, uint16_t k, uint16_t n, uint16_t seed);
 static void     recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k);
+static void     openshadowfile(Shadowfile *s, const char *filename);
+static void     closeshadowfile(Shadowfile *s);
+static void     readshadowbytes(Shadowfile *s, size_t first, size_t count, uint8_t *out);
+static void     parseregion(const char *arg, uint32_t region[static 4]);
+static void     previewsecret(char **filepaths, uint32_t width, int32_t height, uint16_t k);
+static void     lagrangeweights(const uint16_t *xs, uint16_t k, uint16_t x, uint32_t *weights);
+static void     extendshadows(const char *dir, const char *coversdir, uint32_t width, int32_t height, uint16_t k, uint16_t first, uint16_t count);
+static void     recoverregion(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, const uint32_t region[static 4]);
+static bool     isanyshadow(const Fileinfo *fi, uint16_t k, uint32_t secretsize);
+static size_t   countdisagreements(const uint8_t *ys, const uint16_t *xs, size_t m, size_t skip, uint16_t k, size_t samples);
+static int      verifyshadows(const char *dir, uint32_t width, int32_t height, uint16_t k);
+static int      cmpname(const void *a, const void *b);
+static char     **readsequence(const char *path, size_t *count);
+static size_t   framedir(char *buf, size_t size, const Sequence *s, size_t index);
+static Bitmap   *hideincopy(const Bitmap *cover, const Bitmap *shadow, uint32_t size);
+static void     *formframes(void *arg);
+static void     *hideframes(void *arg);
+static void     distributesequence(const char *dir, const char *frames, uint32_t width, int32_t height, uint16_t k, uint16_t n, uint16_t seed);
 static uint32_t calculatepixelarraysize(uint32_t width, int32_t height);
 static void     truncategrayscale(Bitmap *bp);
+static Bitmap   *packsecret(const Bitmap *bp);
+static Bitmap   *unpacksecret(const Bitmap *packed, uint32_t width, int32_t height);
+static uint32_t packedsize(const char *dir, uint16_t k, uint32_t width, int32_t height);
 static void     permutepixels(Bitmap *bp, uint16_t seed);
 static void     unpermutepixels(Bitmap *bp, uint16_t seed);
 static uint8_t  generatepixel(const uint8_t *coeff, uint16_t degree, uint16_t value);
 
 /* globals */
 static const char    *argv0;           /* program name for usage() */
+static bool          legacylayout;     /* also hide bits in the row padding of covers */
+static bool          containerformat;  /* store shadows in containers instead of covers */
+static bool          directio;         /* align containers for O_DIRECT */
+static const char    *outtemplate;     /* where to write shadows; see shadowpath() */
+static const char    *previewfile;     /* where -r writes a preview first */
+static bool          compression;     /* share secrets packed; see packsecret() */
+static Dirindex      *dirindex;        /* directories indexed by --serve */
+static size_t        dircount;
+static pthread_mutex_t indexlock = PTHREAD_MUTEX_INITIALIZER; /* held while dirindex changes */
 static const uint8_t modinv[PRIME] = { /* modular multiplicative inverse */
     0, 1, 126, 84, 63, 201, 42, 36, 157, 28, 226, 137, 21, 58, 18, 67, 204,
     192, 14, 185, 113, 12, 194, 131, 136, 241, 29, 93, 9, 26, 159, 81, 102,
@@ -123,8 +337,11 @@ int
 countfiles(const char *dirname) {
     struct dirent *d;
     int filecount = 0;
-    DIR *dp = xopendir(dirname);
+    const Dirindex *di = finddir(dirname);
 
+    if (di)
+        return di->count;
+    DIR *dp = xopendir(dirname);
     while ((d = readdir(dp))) {
         if (d->d_type == DT_REG) /* If the entry is a regular file */
             filecount++;
@@ -153,36 +370,103 @@ swap(uint8_t *s, uint8_t *t) {
 void
 usage(void) {
     die("usage: %s -(d|r) --secret image -k number -w width -h height -s seed"
-            "[-n number] [--dir directory]\n", argv0);
+            "[-n number] [--dir directory] [--out template] [--region x,y,w,h]"
+            " [--preview image] [--compress] [--legacy] [--container|--odirect]\n"
+            "       %s --extend first -k number -n number -w width -h height [--dir directory]"
+            " [--covers directory] [--out template] [--compress] [--legacy] [--container|--odirect]\n"
+            "       %s -d --sequence frames -k number -w width -h height [-s seed] [-n number]"
+            " [--dir directory] [--out directory] [--compress] [--legacy] [--container|--odirect]\n"
+            "       %s --verify -k number -w width -h height [--dir directory]"
+            " [--compress] [--legacy] [--container]\n"
+            "       %s --serve socket\n"
+            "       %s --connect socket arguments...\n",
+            argv0, argv0, argv0, argv0, argv0, argv0);
+}
+
+bool
+isdirectory(const char *path) {
+    struct stat st;
+    size_t len = strlen(path);
+
+    return (len && path[len - 1] == '/') || (!stat(path, &st) && S_ISDIR(st.st_mode));
+}
+
+/* templates naming a file must have a single %d, and no other conversion
+ * but %% */
+bool
+isvalidtemplate(const char *template) {
+    int numbers = 0;
+
+    if (isdirectory(template))
+        return true;
+    for (const char *t = template; (t = strchr(t, '%')); t += 2) {
+        if (t[1] == 'd')
+            numbers++;
+        else if (t[1] != '%')
+            return false;
+    }
+
+    return numbers == 1;
+}
+
+/* Writes to buf the path for the shadow numbered number. It's shadow<number>.ext
+ * in the current directory, or in the directory given with --out. Otherwise
+ * the --out template is followed, replacing %d with number and %% with % */
+void
+shadowpath(char *buf, size_t size, uint16_t number, const char *ext) {
+    const char *t = outtemplate;
+    size_t len    = 0;
+
+    if (!t || isdirectory(t)) {
+        bool slash = t && t[strlen(t) - 1] != '/';
+        xsnprintf(buf, size, "%s%sshadow%d.%s", t ? t : "", slash ? "/" : "", number, ext);
+        return;
+    }
+
+    for (; *t; t++) {
+        if (*t == '%' && *++t == 'd') {
+            len += xsnprintf(buf + len, size - len, "%d", number);
+        } else {
+            if (len + 1 >= size)
+                die("xsnprintf: snprintf buffer too small\n");
+            buf[len++] = *t;
+        }
+    }
+    buf[len] = '\0';
 }
 
 /* Calculates needed pixelarraysize, accounting for padding.
  * See: https://en.wikipedia.org/wiki/BMP_file_format#Pixel_storage */
 inline uint32_t
 calculatepixelarraysize(uint32_t width, int32_t height) {
-    return ((BITS_PER_PIXEL * width + 31)/32) * 4 * height;
+    return ((BITS_PER_PIXEL * width + 31)/32) * 4 * abs(height);
 }
 
+/* bytes per row of the pixel array, including the padding to 4 bytes */
 uint32_t
-get32bitsfromheader(FILE *fp, int offset) {
-    uint32_t value;
-    long pos = ftell(fp);
-
-    xfseek(fp, offset, SEEK_SET);
-    xfread(&value, sizeof(value), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+bmpstride(const Bitmap *bp) {
+    return ((bp->dibheader.depth * bp->dibheader.width + 31)/32) * 4;
+}
 
-    return value;
+/* bytes per row actually holding pixel data */
+uint32_t
+bmprowbytes(const Bitmap *bp) {
+    return bp->dibheader.width * (bp->dibheader.depth/8);
 }
 
+/* amount of rows; top-down bitmaps have a negative height */
 uint32_t
-bmpfilewidth(FILE *fp) {
-    return get32bitsfromheader(fp, WIDTH_OFFSET);
+bmpheight(const Bitmap *bp) {
+    return abs(bp->dibheader.height);
 }
 
+/* amount of bytes whose LSB can carry a bit of a shadow. Every color channel
+ * is used, so 24 and 32 bpp covers hold 3 and 4 bits per pixel respectively */
 uint32_t
-bmpfileheight(FILE *fp) {
-    return get32bitsfromheader(fp, HEIGHT_OFFSET);
+bmpcapacity(const Bitmap *bp) {
+    uint32_t rowbytes = legacylayout ? bmpstride(bp) : bmprowbytes(bp);
+
+    return rowbytes * bmpheight(bp);
 }
 
 /* initialize palette with default 8-bit greyscale values */
@@ -210,7 +494,7 @@ Bitmap*
 newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum, uint32_t pixelarraysize) {
     Bitmap *bmp = xmalloc(sizeof(*bmp));
 
-    bmp->imgpixels = xmalloc(pixelarraysize);
+    bmp->imgpixels = xpixelalloc(pixelarraysize, 0);
     initpalette(bmp->palette);
 
     bmp->bmpheader = (BMPheader)
@@ -236,13 +520,19 @@ newbitmaphelper(uint32_t width, int32_t height, uint16_t seed, uint16_t shadnum,
         , .nimpcolors     = 0
         };
 
+    bmp->raw     = NULL;
+    bmp->rawsize = 0;
+
     return bmp;
 
 }
 
 void
 freebitmap(Bitmap *bp) {
-    free(bp->imgpixels);
+    if (bp->raw)
+        pixelfree(bp->raw);
+    else
+        pixelfree(bp->imgpixels);
     free(bp);
 }
 
@@ -269,15 +559,24 @@ changedibendianness(DIBheader *h) {
     uint32swap(&h->nimpcolors);
 }
 
+/* copies size bytes from src to dst, returning the position after them */
+const uint8_t *
+getfield(void *dst, const uint8_t *src, size_t size) {
+    memcpy(dst, src, size);
+
+    return src + size;
+}
+
+/* buf must hold at least BMP_HEADER_SIZE bytes */
 void
-readbmpheader(Bitmap *bp, FILE *fp) {
+readbmpheader(Bitmap *bp, const uint8_t *buf) {
     BMPheader *h = &bp->bmpheader;
 
-    xfread(h->id, sizeof(h->id), 1, fp);
-    xfread(&h->size, sizeof(h->size), 1, fp);
-    xfread(&h->unused1, sizeof(h->unused1), 1, fp);
-    xfread(&h->unused2, sizeof(h->unused2), 1, fp);
-    xfread(&h->offset, sizeof(h->offset), 1, fp);
+    buf = getfield(h->id, buf, sizeof(h->id));
+    buf = getfield(&h->size, buf, sizeof(h->size));
+    buf = getfield(&h->unused1, buf, sizeof(h->unused1));
+    buf = getfield(&h->unused2, buf, sizeof(h->unused2));
+    getfield(&h->offset, buf, sizeof(h->offset));
 
     if (isbigendian())
         changeheaderendianness(&bp->bmpheader);
@@ -297,24 +596,61 @@ writebmpheader(const Bitmap *bp, FILE *fp) {
     xfwrite(&(h.offset), sizeof(h.offset), 1, fp);
 }
 
-void
-readdibheader(Bitmap *bp, FILE *fp) {
+/* Reads the DIB header from buf, which holds len bytes. Returns false if the
+ * header is of an unknown kind or doesn't fit. Only the first 40 bytes of the
+ * bigger headers are read, the rest is left untouched in the file */
+bool
+readdibheader(Bitmap *bp, const uint8_t *buf, size_t len) {
     DIBheader *h = &bp->dibheader;
+    uint32_t size;
 
-    xfread(&h->size, sizeof(h->size), 1, fp);
-    xfread(&h->width, sizeof(h->width), 1, fp);
-    xfread(&h->height, sizeof(h->height), 1, fp);
-    xfread(&h->nplanes, sizeof(h->nplanes), 1, fp);
-    xfread(&h->depth, sizeof(h->depth), 1, fp);
-    xfread(&h->compression, sizeof(h->compression), 1, fp);
-    xfread(&h->pixelarraysize, sizeof(h->pixelarraysize), 1, fp);
-    xfread(&h->hres, sizeof(h->hres), 1, fp);
-    xfread(&h->vres, sizeof(h->vres), 1, fp);
-    xfread(&h->ncolors, sizeof(h->ncolors), 1, fp);
-    xfread(&h->nimpcolors, sizeof(h->nimpcolors), 1, fp);
+    if (len < sizeof(size))
+        return false;
+    getfield(&size, buf, sizeof(size));
+    if (isbigendian())
+        uint32swap(&size);
+
+    if (size == CORE_HEADER_SIZE && len >= CORE_HEADER_SIZE) {
+        uint16_t width, height, nplanes, depth;
+
+        buf = getfield(&width, buf + sizeof(size), sizeof(width));
+        buf = getfield(&height, buf, sizeof(height));
+        buf = getfield(&nplanes, buf, sizeof(nplanes));
+        getfield(&depth, buf, sizeof(depth));
+        if (isbigendian()) {
+            uint16swap(&width);
+            uint16swap(&height);
+            uint16swap(&nplanes);
+            uint16swap(&depth);
+        }
+        *h = (DIBheader)
+            { .size    = size
+            , .width   = width
+            , .height  = (int16_t) height
+            , .nplanes = nplanes
+            , .depth   = depth
+            };
+        return true;
+    }
+    if (size < DIB_HEADER_SIZE || len < DIB_HEADER_SIZE)
+        return false;
+
+    buf = getfield(&h->size, buf, sizeof(h->size));
+    buf = getfield(&h->width, buf, sizeof(h->width));
+    buf = getfield(&h->height, buf, sizeof(h->height));
+    buf = getfield(&h->nplanes, buf, sizeof(h->nplanes));
+    buf = getfield(&h->depth, buf, sizeof(h->depth));
+    buf = getfield(&h->compression, buf, sizeof(h->compression));
+    buf = getfield(&h->pixelarraysize, buf, sizeof(h->pixelarraysize));
+    buf = getfield(&h->hres, buf, sizeof(h->hres));
+    buf = getfield(&h->vres, buf, sizeof(h->vres));
+    buf = getfield(&h->ncolors, buf, sizeof(h->ncolors));
+    getfield(&h->nimpcolors, buf, sizeof(h->nimpcolors));
 
     if (isbigendian())
         changedibendianness(&bp->dibheader);
+
+    return true;
 }
 
 void
@@ -337,58 +673,365 @@ writedibheader(const Bitmap *bp, FILE *fp) {
     xfwrite(&(h.nimpcolors), sizeof(h.nimpcolors), 1, fp);
 }
 
+/* Parses the headers at the start of buf, which holds the first len bytes of
+ * a file of filesize bytes. Only uncompressed 8, 24 and 32 bpp bitmaps are
+ * accepted, in either bottom-up or top-down row order. The pixel array is
+ * located through the offset field, so any gap after the DIB header (color
+ * masks, palette, ICC profile) is fine */
+bool
+parseheaders(Bitmap *bp, const uint8_t *buf, size_t len, size_t filesize) {
+    DIBheader *h = &bp->dibheader;
+
+    if (len < BMP_HEADER_SIZE || buf[0] != 'B' || buf[1] != 'M')
+        return false;
+    readbmpheader(bp, buf);
+    if (!readdibheader(bp, buf + BMP_HEADER_SIZE, len - BMP_HEADER_SIZE))
+        return false;
+
+    if (h->depth != 8 && h->depth != 24 && h->depth != 32)
+        return false;
+    if (h->compression != BI_RGB && !(h->compression == BI_BITFIELDS && h->depth == 32))
+        return false;
+    if (!h->width || h->width > INT32_MAX / 32 || !h->height || h->height == INT32_MIN)
+        return false;
+    if (bp->bmpheader.offset < BMP_HEADER_SIZE + h->size)
+        return false;
+
+    uint64_t imgsize = (uint64_t) bmpstride(bp) * bmpheight(bp);
+    if (imgsize > UINT32_MAX || bp->bmpheader.offset + imgsize > filesize)
+        return false;
+    /* the stored value is often 0 for uncompressed images, so don't trust it */
+    h->pixelarraysize = imgsize;
+
+    return true;
+}
+
+/* Reads and parses only the headers of fp, leaving its position unchanged */
+bool
+readheaders(Bitmap *bp, FILE *fp) {
+    uint8_t buf[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    long pos = ftell(fp);
+
+    xfseek(fp, 0, SEEK_SET);
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    xfseek(fp, 0, SEEK_END);
+    long filesize = ftell(fp);
+    xfseek(fp, pos, SEEK_SET);
+
+    return filesize > 0 && parseheaders(bp, buf, len, filesize);
+}
+
+/* The whole file is read with a single call */
 Bitmap *
 bmpfromfile(const char *filename) {
-    FILE *fp = xfopen(filename, "r");
-    Bitmap *bp = xmalloc(sizeof(*bp));
+    size_t size;
+    uint8_t *raw = xreadfile(filename, &size, 0);
 
-    readbmpheader(bp, fp);
-    readdibheader(bp, fp);
-    xfread(bp->palette, sizeof(bp->palette), 1, fp);
+    return bmpfrombuffer(filename, raw, size);
+}
 
-    /* read pixel data */
-    uint32_t imagesize = bmpimagesize(bp);
-    bp->imgpixels = xmalloc(imagesize);
-    xfread(bp->imgpixels, sizeof(bp->imgpixels[0]), imagesize, fp);
-    xfclose(fp);
+/* Builds a bitmap out of raw, the size bytes of filename, and takes ownership
+ * of it. Both the headers and the pixels are used in place */
+Bitmap *
+bmpfrombuffer(const char *filename, uint8_t *raw, size_t size) {
+    Bitmap *bp = xmalloc(sizeof(*bp));
+
+    bp->raw     = raw;
+    bp->rawsize = size;
+    if (!parseheaders(bp, bp->raw, bp->rawsize, bp->rawsize))
+        die("%s: not an uncompressed 8, 24 or 32 bpp BMP file\n", filename);
+    bp->imgpixels = bp->raw + bp->bmpheader.offset;
 
     return bp;
 }
 
 bool
-isvalidbmpsize(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint32_t shadowsize = (secretsize * 8)/k;
-    uint32_t imgsize    = bmpfilewidth(fp) * bmpfileheight(fp);
+hasextension(const char *filename, const char *ext) {
+    const char *dot = strrchr(filename, '.');
+
+    return dot && strcasecmp(dot, ext) == 0;
+}
+
+/* Parses the header of a binary (P5) PGM with a maxval of at most 255.
+ * Returns the offset of the pixel data, or 0 if buf doesn't hold one */
+size_t
+parsepgm(const uint8_t *buf, size_t len, uint32_t *width, int32_t *height) {
+    unsigned long v[3]; /* width, height and maxval */
+    size_t i = 2;
+
+    if (len < 2 || buf[0] != 'P' || buf[1] != '5')
+        return 0;
+
+    for (size_t f = 0; f < 3; f++) {
+        while (i < len && (isspace(buf[i]) || buf[i] == '#')) {
+            if (buf[i] == '#') /* comments last until the end of the line */
+                while (i < len && buf[i] != '\n')
+                    i++;
+            else
+                i++;
+        }
+        if (i == len || !isdigit(buf[i]))
+            return 0;
+        for (v[f] = 0; i < len && isdigit(buf[i]); i++)
+            if ((v[f] = v[f] * 10 + buf[i] - '0') > INT32_MAX)
+                return 0;
+    }
+    /* a single whitespace character separates the header from the data */
+    if (i == len || !isspace(buf[i++]))
+        return 0;
+    if (!v[0] || !v[1] || !v[2] || v[2] > 255 || (uint64_t) v[0] * v[1] > len - i)
+        return 0;
+
+    *width  = v[0];
+    *height = v[1];
+
+    return i;
+}
+
+/* builds an 8-bit bitmap out of unpadded rows given top row first */
+Bitmap *
+bmpfromrows(const uint8_t *rows, uint32_t width, int32_t height) {
+    Bitmap *bp = newbitmap(width, height, 0);
+    uint32_t stride = bmpstride(bp);
+
+    for (int32_t i = 0; i < height; i++)
+        memcpy(bp->imgpixels + (size_t) (height - 1 - i) * stride, rows + (size_t) i * width, width);
+    clearpadding(bp);
+
+    return bp;
+}
+
+/* Secrets can be BMP, binary PGM or raw files, told apart by their extension.
+ * Raw files hold width x height bytes, top row first, with no header nor
+ * padding */
+Bitmap *
+secretfromfile(const char *filename, uint32_t width, int32_t height) {
+    size_t size, offset = 0;
+    uint8_t *buf;
+
+    if (!hasextension(filename, ".pgm") && !hasextension(filename, ".raw"))
+        return bmpfromfile(filename);
+
+    buf = xreadfile(filename, &size, 0);
+    if (hasextension(filename, ".pgm")) {
+        if (!(offset = parsepgm(buf, size, &width, &height)))
+            die("%s: not a binary 8-bit PGM file\n", filename);
+    } else {
+        height = abs(height);
+        if (size != (uint64_t) width * height)
+            die("%s: a %ux%d raw image must be %llu bytes long\n", filename,
+                    width, height, (unsigned long long) width * height);
+    }
+
+    Bitmap *bp = bmpfromrows(buf + offset, width, height);
+    pixelfree(buf);
+
+    return bp;
+}
+
+/* writes an 8-bit bitmap as BMP, binary PGM or raw depending on the extension */
+void
+secrettofile(const Bitmap *bp, const char *filename) {
+    bool pgm = hasextension(filename, ".pgm");
+    uint32_t width  = bp->dibheader.width;
+    uint32_t height = bmpheight(bp);
+    uint32_t stride = bmpstride(bp);
+
+    if (!pgm && !hasextension(filename, ".raw")) {
+        bmptofile(bp, filename);
+        return;
+    }
+
+    FILE *fp = xfopen(filename, "w");
+    if (pgm)
+        fprintf(fp, "P5\n%u %u\n255\n", width, height);
+    for (uint32_t i = 0; i < height; i++) {
+        uint32_t row = bp->dibheader.height > 0 ? height - 1 - i : i;
+        xfwrite(bp->imgpixels + (size_t) row * stride, width, 1, fp);
+    }
+    xfclose(fp);
+}
+
+void
+changeshdendianness(SHDheader *h) {
+    uint16swap(&h->version);
+    uint16swap(&h->seed);
+    uint16swap(&h->shadownumber);
+    uint16swap(&h->k);
+    uint32swap(&h->width);
+    int32swap(&h->height);
+    uint32swap(&h->size);
+    uint32swap(&h->offset);
+    uint32swap(&h->reserved);
+}
 
-    return imgsize >= shadowsize;
+/* copies size bytes from src to dst, returning the position after them */
+uint8_t *
+putfield(uint8_t *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+
+    return dst + size;
 }
 
+/* buf holds the first len bytes of a file of filesize bytes */
 bool
-kdivisiblesize(FILE *fp, uint16_t k) {
-    int pixels = bmpfilewidth(fp) * bmpfileheight(fp);
-    int aux    = pixels / k;
+readshdheader(SHDheader *h, const uint8_t *buf, size_t len, size_t filesize) {
+    if (len < SHD_HEADER_SIZE)
+        return false;
+
+    buf = getfield(h->id, buf, sizeof(h->id));
+    buf = getfield(&h->version, buf, sizeof(h->version));
+    buf = getfield(&h->seed, buf, sizeof(h->seed));
+    buf = getfield(&h->shadownumber, buf, sizeof(h->shadownumber));
+    buf = getfield(&h->k, buf, sizeof(h->k));
+    buf = getfield(&h->width, buf, sizeof(h->width));
+    buf = getfield(&h->height, buf, sizeof(h->height));
+    buf = getfield(&h->size, buf, sizeof(h->size));
+    buf = getfield(&h->offset, buf, sizeof(h->offset));
+    getfield(&h->reserved, buf, sizeof(h->reserved));
+
+    if (isbigendian())
+        changeshdendianness(h);
+
+    return memcmp(h->id, "SHDW", sizeof(h->id)) == 0
+        && h->version == SHD_VERSION && h->shadownumber && h->size
+        && h->offset >= SHD_HEADER_SIZE
+        && (uint64_t) h->offset + h->size <= filesize;
+}
+
+/* buf must hold at least SHD_HEADER_SIZE bytes */
+void
+writeshdheader(const SHDheader *hp, uint8_t *buf) {
+    SHDheader h = *hp;
+
+    if (isbigendian())
+        changeshdendianness(&h);
+
+    buf = putfield(buf, h.id, sizeof(h.id));
+    buf = putfield(buf, &h.version, sizeof(h.version));
+    buf = putfield(buf, &h.seed, sizeof(h.seed));
+    buf = putfield(buf, &h.shadownumber, sizeof(h.shadownumber));
+    buf = putfield(buf, &h.k, sizeof(h.k));
+    buf = putfield(buf, &h.width, sizeof(h.width));
+    buf = putfield(buf, &h.height, sizeof(h.height));
+    buf = putfield(buf, &h.size, sizeof(h.size));
+    buf = putfield(buf, &h.offset, sizeof(h.offset));
+    putfield(buf, &h.reserved, sizeof(h.reserved));
+}
+
+/* Writes the shadow to its container file, named by shadowpath() */
+void
+shadowtocontainer(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height) {
+    char filename[PATH_MAX] = {0};
+
+    shadowpath(filename, PATH_MAX, shadow->bmpheader.unused2, "shd");
+    writecontainer(shadow, k, width, height, filename);
+}
+
+/* Writes the shadow to a container at filename, with a single write */
+void
+writecontainer(const Bitmap *shadow, uint16_t k, uint32_t width, int32_t height, const char *filename) {
+    uint32_t size   = bmpimagesize(shadow);
+    uint32_t offset = directio ? DIRECT_ALIGN : SHD_HEADER_SIZE;
+    size_t total    = (size_t) offset + size;
+
+    if (directio)
+        total = (total + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+
+    uint8_t *buf = xpixelalloc(total, directio ? DIRECT_ALIGN : 0);
+    SHDheader h =
+        { .id           = {'S', 'H', 'D', 'W'}
+        , .version      = SHD_VERSION
+        , .seed         = shadow->bmpheader.unused1
+        , .shadownumber = shadow->bmpheader.unused2
+        , .k            = k
+        , .width        = width
+        , .height       = height
+        , .size         = size
+        , .offset       = offset
+        , .reserved     = 0
+        };
+
+    memset(buf, 0, offset);
+    writeshdheader(&h, buf);
+    memcpy(buf + offset, shadow->imgpixels, size);
+    memset(buf + offset + size, 0, total - offset - size);
+
+    xwritefile(filename, buf, total, directio);
+    pixelfree(buf);
+}
+
+/* The shadow bytes are used in place. Containers padded to DIRECT_ALIGN are
+ * read with O_DIRECT where possible */
+Bitmap *
+containerfromfile(const char *filename) {
+    Bitmap *bp = xmalloc(sizeof(*bp));
+    SHDheader h;
+
+    bp->raw = xreadfile(filename, &bp->rawsize, DIRECT_ALIGN);
+    if (!readshdheader(&h, bp->raw, bp->rawsize, bp->rawsize))
+        die("%s: not a shadow container\n", filename);
 
-    return pixels == aux * k;
+    bp->bmpheader = (BMPheader)
+        { .id[0]   = 'B'
+        , .id[1]   = 'M'
+        , .unused1 = h.seed
+        , .unused2 = h.shadownumber
+        };
+    bp->dibheader = (DIBheader)
+        { .size           = DIB_HEADER_SIZE
+        , .width          = h.size
+        , .height         = 1
+        , .nplanes        = 1
+        , .depth          = BITS_PER_PIXEL
+        , .pixelarraysize = h.size
+        };
+    bp->imgpixels = bp->raw + h.offset;
+
+    return bp;
+}
+
+/* secretsize is the amount of pixels of the secret, see secretpixels() */
+bool
+isvalidbmpsize(const Bitmap *bp, uint16_t k, uint32_t secretsize) {
+    return bmpcapacity(bp) >= (uint64_t) shadowsize(secretsize, k) * 8;
 }
 
+/* size in bytes of the pixel array, padding included */
 uint32_t
 bmpimagesize(const Bitmap *bp) {
-    uint32_t sz = bp->bmpheader.size;
+    return bp->dibheader.pixelarraysize;
+}
+
+/* buf must hold at least BMP_HEADER_SIZE bytes */
+void
+putbmpheader(const Bitmap *bp, uint8_t *buf) {
+    BMPheader h = bp->bmpheader;
 
-    if (sz > 0)
-        return bp->bmpheader.size - bp->bmpheader.offset;
+    if (isbigendian())
+        changeheaderendianness(&h);
 
-    return bp->dibheader.pixelarraysize;
+    buf = putfield(buf, h.id, sizeof(h.id));
+    buf = putfield(buf, &h.size, sizeof(h.size));
+    buf = putfield(buf, &h.unused1, sizeof(h.unused1));
+    buf = putfield(buf, &h.unused2, sizeof(h.unused2));
+    putfield(buf, &h.offset, sizeof(h.offset));
 }
 
 void
 bmptofile(const Bitmap *bp, const char *filename) {
     FILE *fp = xfopen(filename, "w");
 
-    writebmpheader(bp, fp);
-    writedibheader(bp, fp);
-    xfwrite(bp->palette, PALETTE_SIZE, 1, fp);
-    xfwrite(bp->imgpixels, bmpimagesize(bp), 1, fp);
+    if (bp->raw) {
+        /* keep whatever DIB header, masks and palette the file came with */
+        putbmpheader(bp, bp->raw);
+        xfwrite(bp->raw, bp->rawsize, 1, fp);
+    } else {
+        writebmpheader(bp, fp);
+        writedibheader(bp, fp);
+        xfwrite(bp->palette, PALETTE_SIZE, 1, fp);
+        xfwrite(bp->imgpixels, bmpimagesize(bp), 1, fp);
+    }
     xfclose(fp);
 }
 
@@ -398,6 +1041,8 @@ void
 findclosestpair(uint32_t x, uint32_t *width, int32_t *height) {
     unsigned int y = floor(sqrt(x));
 
+    *width  = x; /* for primes and the like */
+    *height = 1;
     for (; y > 2; y--)
         if (x % y == 0) {
             *width  = y;
@@ -411,111 +1056,408 @@ newshadow(uint32_t width, int32_t height, uint16_t seed, uint16_t shadownumber)
     return newbitmaphelper(width, height, seed, shadownumber, width * height);
 }
 
+/* Amount of pixels of a width x height secret that get shared: only the
+ * actual pixels, or the whole padded pixel array with the legacy layout */
+uint32_t
+secretpixels(uint32_t width, int32_t height) {
+    if (legacylayout)
+        return calculatepixelarraysize(width, height);
+
+    return width * abs(height);
+}
+
+/* one shadow pixel per block of k secret pixels; the last block may be short */
+uint32_t
+shadowsize(uint32_t pixels, uint16_t k) {
+    return ((uint64_t) pixels + k - 1)/k;
+}
+
+/* zeroes the bytes padding each row to 4 bytes */
+void
+clearpadding(Bitmap *bp) {
+    uint32_t stride   = bmpstride(bp);
+    uint32_t rowbytes = bmprowbytes(bp);
+
+    if (stride == rowbytes)
+        return;
+    for (uint32_t i = 0; i < bmpheight(bp); i++)
+        memset(bp->imgpixels + (size_t) i * stride + rowbytes, 0, stride - rowbytes);
+}
+
+void
+initblocks(Blocks *b, const Bitmap *bp, uint16_t k) {
+    initsecretcursor(&b->c, bp);
+    b->left    = secretpixels(bp->dibheader.width, bp->dibheader.height);
+    b->k       = k;
+    b->count   = 0;
+    b->scratch = xmalloc(k);
+}
+
+/* Returns the next k pixels, or NULL once there are none left. Missing pixels
+ * of a short last block read as 0 */
+uint8_t *
+nextblock(Blocks *b) {
+    Cursor *c = &b->c;
+
+    if (!b->left)
+        return NULL;
+    if (c->col == c->rowbytes) {
+        c->row += c->stride;
+        c->col = 0;
+    }
+
+    b->start = *c;
+    b->count = b->left < b->k ? b->left : b->k;
+    b->left -= b->count;
+    if (b->count == b->k && c->rowbytes - c->col >= b->k) {
+        c->col += b->k;
+        return &b->start.row[b->start.col];
+    }
+
+    for (uint16_t i = 0; i < b->k; i++)
+        b->scratch[i] = i < b->count ? *nextbyte(c) : 0;
+
+    return b->scratch;
+}
+
+/* writes back block if it was gathered into scratch and then modified */
+void
+endblock(Blocks *b, const uint8_t *block) {
+    Cursor c = b->start;
+
+    if (block != b->scratch)
+        return;
+    for (uint16_t i = 0; i < b->count; i++)
+        *nextbyte(&c) = block[i];
+}
+
+void
+freeblocks(Blocks *b) {
+    free(b->scratch);
+}
+
 Bitmap **
 formshadows(const Bitmap *bp, uint16_t k, uint16_t n, uint16_t seed) {
     uint32_t width;
     int32_t height;
-    uint32_t pixelarraysize = bmpimagesize(bp);
+    uint32_t size = shadowsize(secretpixels(bp->dibheader.width, bp->dibheader.height), k);
     Bitmap **shadows = xmalloc(sizeof(*shadows) * n);
+    uint8_t *coeff;
+    Blocks b;
 
-    findclosestpair(pixelarraysize/k, &width, &height);
+    findclosestpair(size, &width, &height);
 
     /* allocate shadows */
     for (size_t i = 0; i < n; i++)
         shadows[i] = newshadow(width, height, seed, i+1);
 
     /* generate shadow image pixels */
-    for (size_t j = 0; j*k < pixelarraysize; j++) {
-        uint8_t *coeff = &bp->imgpixels[j*k];
+    initblocks(&b, bp, k);
+    for (size_t j = 0; (coeff = nextblock(&b)); j++) {
         for (size_t i = 0; i < n; i++)
             shadows[i]->imgpixels[j] = generatepixel(coeff, k-1, i+1);
     }
+    freeblocks(&b);
 
     return shadows;
 }
 
-/* Gauss-Jordan elimination under modular arithmetic */
-void
-findcoefficients(int **mat, uint16_t k) {
+/* Every block is solved against the same shadow numbers, so the inverse of
+ * their Vandermonde matrix maps the k shadow values of any block straight to
+ * its coefficients. Column j holds the coefficients of the Lagrange basis
+ * polynomial of xs[j], i.e. prod(x - xs[m]) / (x - xs[j]), found by synthetic
+ * division, times the barycentric weight 1 / prod(xs[j] - xs[m]), m != j.
+ * O(k^2) in all */
+uint32_t *
+vandermondeinverse(const uint16_t *xs, uint16_t k) {
+    uint32_t *inv = xmalloc(sizeof(*inv) * k * k);
+    uint32_t *m   = xmalloc(sizeof(*m) * (k+1));
+    uint32_t *q   = xmalloc(sizeof(*q) * k);
+
+    /* m = prod(x - xs[j]) */
+    m[0] = 1;
+    for (size_t j = 0; j < k; j++) {
+        uint32_t x = xs[j] % PRIME;
+        m[j+1] = m[j];
+        for (size_t i = j; i > 0; i--)
+            m[i] = (m[i-1] + (PRIME - x) * m[i]) % PRIME;
+        m[0] = (PRIME - x) * m[0] % PRIME;
+    }
 
-    /* take matrix to echelon form */
-    for (size_t j = 0; j < k-1; j++) {
-        for (size_t i = k-1; i > j; i--) {
-            int a = mat[i][j] * modinv[mat[i-1][j]];
-            for (size_t t = j; t < k+1; t++) {
-                int temp = mat[i][t] - ((mat[i-1][t] * a) % PRIME);
-                mat[i][t] = mod(temp, PRIME);
-            }
-        }
+    for (size_t j = 0; j < k; j++) {
+        uint32_t x = xs[j] % PRIME;
+        uint32_t d = 1;
+
+        q[k-1] = m[k];
+        for (size_t i = k-1; i > 0; i--)
+            q[i-1] = (m[i] + x * q[i]) % PRIME;
+        for (size_t i = 0; i < k; i++)
+            if (i != j)
+                d = d * (x + PRIME - xs[i] % PRIME) % PRIME;
+        if (!d)
+            die("shadow number %d appears more than once\n", xs[j]);
+        for (size_t t = 0; t < k; t++)
+            inv[t * k + j] = q[t] * modinv[d] % PRIME;
     }
+    free(m);
+    free(q);
 
-    /* take matrix to reduced row echelon form */
-    for (size_t i = k-1; i > 0; i--) {
-        mat[i][k] = (mat[i][k] * modinv[mat[i][i]]) % PRIME;
-        mat[i][i] = (mat[i][i] * modinv[mat[i][i]]) % PRIME;
-        for (int t = i-1; t >= 0; t--) {
-            int temp = mat[t][k] - ((mat[i][k] * mat[t][i]) % PRIME);
-            mat[t][k] = mod(temp, PRIME);
-            mat[t][i] = 0;
-        }
+    return inv;
+}
+
+/* block = inv * ys. Each term is at most 250 * 250, so even k = 65535 of them
+ * fit in 32 bits */
+void
+combineblock(const uint32_t *inv, const uint8_t *ys, uint16_t k, uint8_t *block) {
+    for (size_t t = 0; t < k; t++) {
+        uint32_t sum = 0;
+        for (size_t j = 0; j < k; j++)
+            sum += inv[t * k + j] * ys[j];
+        block[t] = sum % PRIME;
     }
 }
 
+/* Blocks are solved a tile at a time: for each coefficient, the rows of the
+ * inverse are combined with the k shadows' runs of tile bytes, which stay in
+ * cache, in loops over consecutive blocks the compiler vectorizes */
 Bitmap *
 revealsecret(Bitmap **shadows, uint32_t width, int32_t height, uint16_t k) {
-    uint32_t pixels = (*shadows)->dibheader.pixelarraysize;
-    Bitmap *bmp = newbitmap(width, height, (*shadows)->bmpheader.unused1);
-
-    int **mat = xmalloc(sizeof(*mat) * k);
-    for (size_t i = 0; i < k; i++)
-        mat[i] = xmalloc(sizeof(**mat) * (k+1));
-
-    for (size_t i = 0; i < pixels; i++) {
-        for (size_t j = 0; j < k; j++) {
-            Bitmap *sp = shadows[j];
-            int value = sp->bmpheader.unused2;
-            mat[j][0] = 1;
-            for (size_t t = 1; t < k; t++) {
-                mat[j][t] = value;
-                value *= sp->bmpheader.unused2;
+    uint32_t pixels   = (*shadows)->dibheader.pixelarraysize;
+    Bitmap *bmp       = newbitmap(width, height, (*shadows)->bmpheader.unused1);
+    size_t tileblocks = TILE_PIXELS/k ? TILE_PIXELS/k : 1;
+    uint16_t *xs      = xmalloc(sizeof(*xs) * k);
+    uint32_t *sums    = xmalloc(sizeof(*sums) * tileblocks);
+    uint8_t *tile     = xmalloc(tileblocks * k);
+    uint8_t *block    = NULL;
+    Blocks b;
+
+    for (size_t j = 0; j < k; j++)
+        xs[j] = shadows[j]->bmpheader.unused2;
+    uint32_t *inv = vandermondeinverse(xs, k);
+
+    initblocks(&b, bmp, k);
+    for (size_t i = 0; i < pixels; i += tileblocks) {
+        size_t count = pixels - i < tileblocks ? pixels - i : tileblocks;
+
+        for (size_t t = 0; t < k; t++) {
+            memset(sums, 0, sizeof(*sums) * count);
+            for (size_t j = 0; j < k; j++) {
+                const uint8_t *ys = shadows[j]->imgpixels + i;
+                uint32_t c        = inv[t * k + j];
+                for (size_t l = 0; l < count; l++)
+                    sums[l] += c * ys[l];
             }
-            mat[j][k] = sp->imgpixels[i];
+            for (size_t l = 0; l < count; l++)
+                tile[l * k + t] = sums[l] % PRIME;
         }
-        findcoefficients(mat, k);
-        for (size_t j = i * k; j < (i+1) * k; j++) {
-            bmp->imgpixels[j] = mat[j % k][k];
+        for (size_t l = 0; l < count && (block = nextblock(&b)); l++) {
+            memcpy(block, tile + l * k, k);
+            endblock(&b, block);
         }
+        if (!block)
+            break;
     }
+    freeblocks(&b);
+    clearpadding(bmp);
 
     //unpermutepixels(bmp, sp->bmpheader.unused1);
 
-    for (size_t i = 0; i < k; i++)
-        free(mat[i]);
-    free(mat);
+    free(inv);
+    free(xs);
+    free(sums);
+    free(tile);
 
     return bmp;
 }
 
+/* Rows are walked in file order, so top-down covers need no special care */
 void
-hideshadow(Bitmap *bp, const Bitmap *shadow) {
-    char shadowfilename[20] = {0};
-    uint32_t pixels = bmpimagesize(shadow);
+initcursor(Cursor *c, const Bitmap *bp) {
+    c->row      = bp->imgpixels;
+    c->col      = 0;
+    c->stride   = bmpstride(bp);
+    c->rowbytes = legacylayout ? c->stride : bmprowbytes(bp);
+}
 
-    bp->bmpheader.unused1 = shadow->bmpheader.unused1;
-    bp->bmpheader.unused2 = shadow->bmpheader.unused2;
-    xsnprintf(shadowfilename, 20, "shadow%d.bmp", shadow->bmpheader.unused2);
+/* Secrets are walked bottom row first whatever their row order, so that the
+ * bottom-up bitmaps revealsecret() makes come out the right way up */
+void
+initsecretcursor(Cursor *c, const Bitmap *bp) {
+    initcursor(c, bp);
+    if (bp->dibheader.height < 0 && !legacylayout) {
+        c->row   += (bmpheight(bp) - 1) * c->stride;
+        c->stride = -c->stride;
+    }
+}
 
-    for (size_t i = 0; i < pixels; i++) {
-        uint8_t byte = shadow->imgpixels[i];
-        for (size_t j = i*8; j < 8*(i+1); j++) {
-            if (byte & 0x80) /* 1000 0000 */
-                RIGHTMOST_BIT_ON(bp->imgpixels[j]);
-            else
-                RIGHTMOST_BIT_OFF(bp->imgpixels[j]);
-            byte <<= 1;
+inline uint8_t *
+nextbyte(Cursor *c) {
+    if (c->col == c->rowbytes) {
+        c->row += c->stride;
+        c->col = 0;
+    }
+
+    return &c->row[c->col++];
+}
+
+/* hides byte in the LSBs of the next 8 bytes of c, most significant bit first */
+inline void
+hidebyte(Cursor *c, uint8_t byte) {
+    for (size_t j = 0; j < 8; j++) {
+        uint8_t *p = nextbyte(c);
+        if (byte & 0x80) /* 1000 0000 */
+            RIGHTMOST_BIT_ON(*p);
+        else
+            RIGHTMOST_BIT_OFF(*p);
+        byte <<= 1;
+    }
+}
+
+/* Evaluates count section polynomials, k coefficients each, at the shadow
+ * number of every cover, hiding each result right away through cursors.
+ * Covers are gone through one at a time so each gets a sequential run of
+ * writes while the tile stays in cache */
+void
+hidetile(const uint8_t *coeff, size_t count, uint16_t k, Bitmap **covers, Cursor *cursors, uint16_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint16_t x = covers[i]->bmpheader.unused2;
+        for (size_t j = 0; j < count; j++)
+            hidebyte(&cursors[i], generatepixel(coeff + j * k, k-1, x));
+    }
+}
+
+/* Forms the shadows of bp numbered from first on and hides them in the n
+ * covers in a single sweep over the secret: each tile of about TILE_PIXELS
+ * pixels is clipped to the field and evaluated straight into the LSBs of every
+ * cover, so neither a truncated copy of the secret nor the shadows themselves
+ * are ever built */
+void
+formandhideshadows(const Bitmap *bp, Bitmap **covers, uint16_t k, uint16_t n, uint16_t first, uint16_t seed) {
+    size_t tileblocks = TILE_PIXELS/k ? TILE_PIXELS/k : 1;
+    uint8_t *tile     = xmalloc(tileblocks * k);
+    Cursor *cursors   = xmalloc(sizeof(*cursors) * n);
+    uint8_t *block;
+    Blocks b;
+
+    for (size_t i = 0; i < n; i++) {
+        covers[i]->bmpheader.unused1 = seed;
+        covers[i]->bmpheader.unused2 = first + i;
+        putbmpheader(covers[i], covers[i]->raw);
+        initcursor(&cursors[i], covers[i]);
+    }
+
+    initblocks(&b, bp, k);
+    for (;;) {
+        size_t count = 0;
+        for (; count < tileblocks && (block = nextblock(&b)); count++) {
+            uint8_t *t = tile + count * k;
+            for (size_t j = 0; j < k; j++)
+                t[j] = block[j] < PRIME ? block[j] : PRIME - 1;
+        }
+        if (!count)
+            break;
+        hidetile(tile, count, k, covers, cursors, n);
+    }
+    freeblocks(&b);
+    free(cursors);
+    free(tile);
+}
+
+/* Hides the shadows of bp in the n covers of filepaths, IO_AHEAD covers at a
+ * time. While the secret is swept for one window of covers, the next window is
+ * being read and the previous one written, so the I/O overlaps the arithmetic
+ * and no more than three windows of covers are ever in memory */
+void
+hideincovers(const Bitmap *bp, char **filepaths, uint16_t k, uint16_t n, uint16_t seed) {
+    char shadowfilename[PATH_MAX] = {0};
+    Bitmap **covers = xmalloc(sizeof(*covers) * n);
+    Aioreq *reads   = xmalloc(sizeof(*reads) * n);
+    Aioreq *writes  = xmalloc(sizeof(*writes) * n);
+    Aio *aio        = aioinit(IO_DEPTH);
+
+    for (size_t i = 0; i < n && i < IO_AHEAD; i++)
+        aioread(aio, &reads[i], filepaths[i]);
+
+    for (size_t w = 0; w < n; w += IO_AHEAD) {
+        size_t end = w + IO_AHEAD < n ? w + IO_AHEAD : n;
+
+        for (size_t i = w; i < end; i++) {
+            aiowait(aio, &reads[i]);
+            covers[i] = bmpfrombuffer(filepaths[i], reads[i].buf, reads[i].size);
+        }
+        for (size_t i = end; i < n && i < end + IO_AHEAD; i++)
+            aioread(aio, &reads[i], filepaths[i]);
+
+        formandhideshadows(bp, covers + w, k, end - w, w + 1, seed);
+
+        for (size_t i = w >= IO_AHEAD ? w - IO_AHEAD : w; i < w; i++) {
+            aiowait(aio, &writes[i]);
+            freebitmap(covers[i]);
+        }
+        for (size_t i = w; i < end; i++) {
+            shadowpath(shadowfilename, PATH_MAX, i + 1, "bmp");
+            aiowrite(aio, &writes[i], shadowfilename, covers[i]->raw, covers[i]->rawsize);
+        }
+    }
+
+    for (size_t i = (n - 1) / IO_AHEAD * IO_AHEAD; i < n; i++) {
+        aiowait(aio, &writes[i]);
+        freebitmap(covers[i]);
+    }
+    aiofree(aio);
+    free(covers);
+    free(reads);
+    free(writes);
+}
+
+/* Reads the n covers of filepaths, keeping up to IO_AHEAD reads in flight */
+Bitmap **
+readcovers(char **filepaths, uint16_t n) {
+    Bitmap **covers = xmalloc(sizeof(*covers) * n);
+    Aioreq *reads   = xmalloc(sizeof(*reads) * n);
+    Aio *aio        = aioinit(IO_DEPTH);
+
+    for (size_t i = 0; i < n && i < IO_AHEAD; i++)
+        aioread(aio, &reads[i], filepaths[i]);
+
+    for (size_t i = 0; i < n; i++) {
+        aiowait(aio, &reads[i]);
+        if (i + IO_AHEAD < n)
+            aioread(aio, &reads[i + IO_AHEAD], filepaths[i + IO_AHEAD]);
+        covers[i] = bmpfrombuffer(filepaths[i], reads[i].buf, reads[i].size);
+    }
+    aiofree(aio);
+    free(reads);
+
+    return covers;
+}
+
+/* Writes the covers through aio, keeping up to IO_AHEAD writes in flight, and
+ * frees them. They go where shadowpath() says, or to shadow<number>.bmp in
+ * dir if it isn't NULL */
+void
+writecovers(Aio *aio, Bitmap **covers, uint16_t n, const char *dir) {
+    char shadowfilename[PATH_MAX] = {0};
+    Aioreq *writes = xmalloc(sizeof(*writes) * n);
+
+    for (size_t i = 0; i < n; i++) {
+        uint16_t number = covers[i]->bmpheader.unused2;
+        if (i >= IO_AHEAD) {
+            aiowait(aio, &writes[i - IO_AHEAD]);
+            freebitmap(covers[i - IO_AHEAD]);
         }
+        if (dir)
+            xsnprintf(shadowfilename, PATH_MAX, "%s/shadow%d.bmp", dir, number);
+        else
+            shadowpath(shadowfilename, PATH_MAX, number, "bmp");
+        aiowrite(aio, &writes[i], shadowfilename, covers[i]->raw, covers[i]->rawsize);
     }
-    bmptofile(bp, shadowfilename);
+
+    for (size_t i = n > IO_AHEAD ? n - IO_AHEAD : 0; i < n; i++) {
+        aiowait(aio, &writes[i]);
+        freebitmap(covers[i]);
+    }
+    free(writes);
 }
 
 /* width and height parameters needed because the image hiding the shadow could
@@ -525,15 +1467,17 @@ retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
     uint16_t key          = bp->bmpheader.unused1;
     uint16_t shadownumber = bp->bmpheader.unused2;
 
-    findclosestpair(calculatepixelarraysize(width, height)/k, &width, &height);
+    findclosestpair(shadowsize(secretpixels(width, height), k), &width, &height);
     Bitmap *shadow = newshadow(width, height, key, shadownumber);
     uint32_t shadowpixels = shadow->dibheader.pixelarraysize;
+    Cursor c;
 
+    initcursor(&c, bp);
     for (uint32_t i = 0; i < shadowpixels; i++) {
         uint8_t byte = 0;
         uint8_t mask = 0x80; /* 1000 0000 */
-        for (uint32_t j = i*8; j < 8*(i+1); j++) {
-            if (bp->imgpixels[j] & 0x01)
+        for (uint32_t j = 0; j < 8; j++) {
+            if (*nextbyte(&c) & 0x01)
                 byte |= mask;
             mask >>= 1;
         }
@@ -543,62 +1487,287 @@ retrieveshadow(const Bitmap *bp, uint32_t width, int32_t height, uint16_t k) {
     return shadow;
 }
 
-bool
-isbmp(FILE *fp) {
-    char magicnumber[2];
-    long pos = ftell(fp);
+/* Extracts the shadows hidden in the k covers of filepaths, reading up to
+ * IO_AHEAD covers ahead of the one being worked on */
+Bitmap **
+retrieveshadows(char **filepaths, uint32_t width, int32_t height, uint16_t k) {
+    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+    Aioreq *reads    = xmalloc(sizeof(*reads) * k);
+    Aio *aio         = aioinit(IO_DEPTH);
 
-    xfseek(fp, 0, SEEK_SET);
-    xfread(magicnumber, sizeof(magicnumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+    for (size_t i = 0; i < k && i < IO_AHEAD; i++)
+        aioread(aio, &reads[i], filepaths[i]);
+
+    for (size_t i = 0; i < k; i++) {
+        aiowait(aio, &reads[i]);
+        if (i + IO_AHEAD < k)
+            aioread(aio, &reads[i + IO_AHEAD], filepaths[i + IO_AHEAD]);
+
+        Bitmap *bp = bmpfrombuffer(filepaths[i], reads[i].buf, reads[i].size);
+        shadows[i] = retrieveshadow(bp, width, height, k);
+        freebitmap(bp);
+    }
+    aiofree(aio);
+    free(reads);
 
-    return magicnumber[0] == 'B' && magicnumber[1] == 'M';
+    return shadows;
 }
 
+/* isvalidbmpsize() for the headers in fi */
 bool
-isvalidshadow(FILE *fp, uint16_t k, uint32_t secretsize) {
-    uint16_t shadownumber;
-    long pos = ftell(fp);
+hascapacity(const Fileinfo *fi, uint16_t k, uint32_t secretsize) {
+    uint32_t rowbytes = legacylayout ? fi->stride : fi->rowbytes;
 
-    xfseek(fp, UNUSED2_OFFSET, SEEK_SET);
-    xfread(&shadownumber, sizeof(shadownumber), 1, fp);
-    xfseek(fp, pos, SEEK_SET);
+    return (uint64_t) rowbytes * fi->height >= (uint64_t) shadowsize(secretsize, k) * 8;
+}
 
-    return shadownumber && isbmp(fp) && isvalidbmpsize(fp, k, secretsize);
+bool
+isvalidshadow(const Fileinfo *fi, uint16_t k, uint32_t secretsize) {
+    return fi->bmp && fi->number && hascapacity(fi, k, secretsize);
 }
 
-/* the last parameter is ignored, and is only present so that the function
- * prototype can be used with getvalidfilenames() */
 bool
-isvalidbmp(FILE *fp, uint16_t k, uint32_t ignoredparameter) {
-    return isbmp(fp) && kdivisiblesize(fp, k);
+isvalidbmp(const Fileinfo *fi, uint16_t k, uint32_t secretsize) {
+    return fi->bmp && hascapacity(fi, k, secretsize);
 }
 
-char **
-getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
+bool
+isvalidcontainer(const Fileinfo *fi, uint16_t k, uint32_t secretsize) {
+    const SHDheader *h = &fi->h;
+
+    /* packed secrets are only known to be at most secretsize long */
+    return fi->container && h->k == k
+        && (compression ? h->size >= shadowsize(secretsize, k) : h->size == shadowsize(secretsize, k));
+}
+
+void
+readfileinfo(Fileinfo *fi, FILE *fp) {
+    uint8_t buf[SHD_HEADER_SIZE];
+    Bitmap b;
+
+    if ((fi->bmp = readheaders(&b, fp))) {
+        fi->number   = b.bmpheader.unused2;
+        fi->rowbytes = bmprowbytes(&b);
+        fi->stride   = bmpstride(&b);
+        fi->height   = bmpheight(&b);
+    }
+
+    xfseek(fp, 0, SEEK_SET);
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    xfseek(fp, 0, SEEK_END);
+    long filesize = ftell(fp);
+    fi->container = filesize > 0 && readshdheader(&fi->h, buf, len, filesize);
+}
+
+/* Reads the headers of filepath */
+bool
+getfileinfo(const char *filepath, Fileinfo *fi) {
+    FILE *fp = fopen(filepath, "r");
+
+    if (!fp)
+        return false;
+    readfileinfo(fi, fp);
+    xfclose(fp);
+
+    return true;
+}
+
+void
+freedirindex(Dirindex *di) {
+    for (size_t i = 0; i < di->count; i++)
+        free(di->files[i].name);
+    free(di->files);
+}
+
+/* The index of dir if it's still as it was read, which is only ever the case
+ * under --serve. Costs a stat() of dir, instead of reading it and every file */
+const Dirindex *
+finddir(const char *dir) {
+    struct stat st;
+
+    if (!dircount || stat(dir, &st))
+        return NULL;
+    for (size_t i = 0; i < dircount; i++) {
+        const Dirindex *di = &dirindex[i];
+        if (di->dev == st.st_dev && di->ino == st.st_ino)
+            return di->settled && di->mtime.tv_sec == st.st_mtim.tv_sec
+                && di->mtime.tv_nsec == st.st_mtim.tv_nsec ? di : NULL;
+    }
+
+    return NULL;
+}
+
+/* Reads dir into the index, unless it's there and unchanged. The least
+ * recently used of INDEX_DIRS directories makes room for a new one. Run by a
+ * thread of the server itself, so nothing here may die() */
+void
+indexdir(const char *dir) {
+    static uint64_t tick;
+    char filepath[PATH_MAX];
     struct dirent *d;
-    FILE *fp;
-    DIR *dp = xopendir(dir);
+    struct stat st;
+    struct timespec now;
+    size_t capacity = 0;
+    Dirindex fresh  = {0};
+    Dirindex *di    = NULL;
+    DIR *dp = opendir(dir);
+
+    if (!dp)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (fstat(dirfd(dp), &st)) {
+        closedir(dp);
+        return;
+    }
+    for (size_t i = 0; i < dircount; i++)
+        if (dirindex[i].dev == st.st_dev && dirindex[i].ino == st.st_ino)
+            di = &dirindex[i];
+    if (di && di->settled && di->mtime.tv_sec == st.st_mtim.tv_sec
+            && di->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        lockindex();
+        di->used = ++tick;
+        unlockindex();
+        closedir(dp);
+        return;
+    }
+
+    fresh.dev   = st.st_dev;
+    fresh.ino   = st.st_ino;
+    fresh.mtime = st.st_mtim;
+    /* a change in the same tick as mtime, once read, wouldn't show. That
+     * can't happen once a tick has passed; two seconds cover coarse ones */
+    fresh.settled = st.st_mtim.tv_sec + 2 <= now.tv_sec;
+    while ((d = readdir(dp))) {
+        if (d->d_type != DT_REG)
+            continue;
+        if (fresh.count == capacity) {
+            Indexentry *grown = realloc(fresh.files, sizeof(*grown) * (capacity ? 2 * capacity : 64));
+            if (!grown)
+                break;
+            fresh.files = grown;
+            capacity    = capacity ? 2 * capacity : 64;
+        }
+        Indexentry *e = &fresh.files[fresh.count];
+        FILE *fp;
+        /* a request would die() on it, so leave dir to be read by each */
+        if (snprintf(filepath, sizeof(filepath), "%s/%s", dir, d->d_name) >= (int) sizeof(filepath)
+                || !(fp = fopen(filepath, "r")))
+            break;
+        readfileinfo(&e->info, fp);
+        fclose(fp);
+        if (!(e->name = strdup(d->d_name)))
+            break;
+        fresh.count++;
+    }
+    closedir(dp);
+    if (d) {
+        freedirindex(&fresh);
+        return;
+    }
+
+    /* only this thread changes the index, so it may look without the lock */
+    if (!di && dircount == INDEX_DIRS) {
+        di = &dirindex[0];
+        for (size_t i = 1; i < dircount; i++)
+            if (dirindex[i].used < di->used)
+                di = &dirindex[i];
+    }
+    Dirindex old = {0};
+    lockindex();
+    if (!di) {
+        Dirindex *grown = realloc(dirindex, sizeof(*grown) * (dircount + 1));
+        if (!grown) {
+            unlockindex();
+            freedirindex(&fresh);
+            return;
+        }
+        dirindex = grown;
+        di       = &dirindex[dircount++];
+    } else {
+        old = *di;
+    }
+    fresh.used = ++tick;
+    *di = fresh;
+    unlockindex();
+    freedirindex(&old);
+}
+
+/* Run around fork() too, so a child of --serve gets the index whole */
+void
+lockindex(void) {
+    pthread_mutex_lock(&indexlock);
+}
+
+void
+unlockindex(void) {
+    pthread_mutex_unlock(&indexlock);
+}
+
+/* Indexes the directories a request will look for covers or shadows in, so
+ * the next ones needn't read their headers again */
+void
+warmindex(int argc, char *argv[]) {
+    bool dir = false;
+
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--dir") == 0 || strcmp(argv[i], "--covers") == 0) {
+            dir |= strcmp(argv[i], "--dir") == 0;
+            indexdir(argv[++i]);
+        }
+    }
+    if (!dir)
+        indexdir(".");
+}
+
+/* Paths to up to max files in dir that pass isvalid, their number left in
+ * count */
+char **
+findvalidfilenames(const char *dir, uint16_t k, size_t max, fn isvalid, uint32_t size, size_t *count) {
+    struct dirent *d;
+    Fileinfo fi;
     size_t i = 0;
     char filepath[PATH_MAX] = {0};
-    char **filenames = xmalloc(sizeof(*filenames) * n);
+    char **filenames = xmalloc(sizeof(*filenames) * (max ? max : 1));
+    const Dirindex *di = finddir(dir);
 
-    while ((d = readdir(dp)) && i < n) {
+    if (di) {
+        for (size_t j = 0; j < di->count && i < max; j++) {
+            if (isvalid(&di->files[j].info, k, size)) {
+                size_t len = xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, di->files[j].name);
+                filenames[i] = xmalloc(len + 1UL);
+                memcpy(filenames[i++], filepath, len + 1UL);
+            }
+        }
+        *count = i;
+        return filenames;
+    }
+
+    DIR *dp = xopendir(dir);
+    while ((d = readdir(dp)) && i < max) {
         if (d->d_type == DT_REG) {
             size_t len = xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, dir, NAME_MAX, d->d_name);
-            fp = xfopen(filepath, "r");
-            if (isvalid(fp, k, size)) {
+            if (!getfileinfo(filepath, &fi))
+                die("fopen: couldn't open %s\n", filepath);
+            if (isvalid(&fi, k, size)) {
                 filenames[i] = xmalloc(len + 1UL);
                 strncpy(filenames[i], filepath, len);
                 filenames[i][len] = '\0'; /* NULL terminate string */
                 i++;
             }
-            xfclose(fp);
         }
     }
     xclosedir(dp);
+    *count = i;
 
-    if (i < n)
+    return filenames;
+}
+
+char **
+getvalidfilenames(const char *dir, uint16_t k, uint16_t n, fn isvalid, uint32_t size) {
+    size_t count;
+    char **filenames = findvalidfilenames(dir, k, n, isvalid, size, &count);
+
+    if (count < n)
         die("not enough valid bmps for a (%d,%d) threshold scheme in dir %s\n", k, n, dir);
 
     return filenames;
@@ -614,24 +1783,77 @@ getshadowfilenames(const char *dir, uint16_t k, uint32_t size) {
     return getvalidfilenames(dir, k, k, isvalidshadow, size);
 }
 
+char **
+getcontainerfilenames(const char *dir, uint16_t k, uint32_t size) {
+    return getvalidfilenames(dir, k, k, isvalidcontainer, size);
+}
+
+/* width and height are only used for raw secrets */
 void
-distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, uint16_t seed) {
-    Bitmap *bmp, **shadows;
+distributeimage(const char *dir, const char *imgpath, uint32_t width, int32_t height, uint16_t k, uint16_t n, uint16_t seed) {
+    Bitmap *bmp = secretfromfile(imgpath, width, height);
+
+    if (bmp->dibheader.depth != BITS_PER_PIXEL)
+        die("%s: the secret must be an 8-bit greyscale image\n", imgpath);
+    if (compression) {
+        Bitmap *packed = packsecret(bmp);
+        freebitmap(bmp);
+        bmp = packed;
+    }
 
-    bmp = bmpfromfile(imgpath);
-    char ** filepaths = getbmpfilenames(dir, k, n, bmpimagesize(bmp));
-    truncategrayscale(bmp);
-    //permutepixels(bmp, seed);
-    shadows = formshadows(bmp, k, n, seed);
+    if (containerformat) {
+        truncategrayscale(bmp);
+        //permutepixels(bmp, seed);
+        Bitmap **shadows = formshadows(bmp, k, n, seed);
+        for (size_t i = 0; i < n; i++) {
+            shadowtocontainer(shadows[i], k, bmp->dibheader.width, bmp->dibheader.height);
+            freebitmap(shadows[i]);
+        }
+        free(shadows);
+    } else {
+        char **filepaths = getbmpfilenames(dir, k, n, secretpixels(bmp->dibheader.width, bmp->dibheader.height));
+        /* permuting would need its own pass over bmp before the sweeps */
+        //permutepixels(bmp, seed);
+        hideincovers(bmp, filepaths, k, n, seed);
+        for (size_t i = 0; i < n; i++)
+            free(filepaths[i]);
+        free(filepaths);
+    }
     freebitmap(bmp);
+}
 
-    for (size_t i = 0; i < n; i++) {
-        bmp = bmpfromfile(filepaths[i]);
-        hideshadow(bmp, shadows[i]);
-        freebitmap(bmp);
+void
+recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
+    uint32_t sharedwidth  = compression ? packedsize(dir, k, width, height) : width;
+    int32_t sharedheight  = compression ? 1 : height;
+    Bitmap **shadows;
+    char **filepaths;
+
+    if (containerformat)
+        filepaths = getcontainerfilenames(dir, k, secretpixels(sharedwidth, sharedheight));
+    else
+        filepaths = getshadowfilenames(dir, k, secretpixels(sharedwidth, sharedheight));
+    if (previewfile)
+        previewsecret(filepaths, width, height, k);
+
+    if (containerformat) {
+        shadows = xmalloc(sizeof(*shadows) * k);
+        for (size_t i = 0; i < k; i++)
+            shadows[i] = containerfromfile(filepaths[i]);
+    } else {
+        shadows = retrieveshadows(filepaths, sharedwidth, sharedheight, k);
     }
 
-    for (size_t i = 0; i < n; i++) {
+    Bitmap *bmp = revealsecret(shadows, sharedwidth, sharedheight, k);
+    if (compression) {
+        Bitmap *packed = bmp;
+        bmp = unpacksecret(packed, width, height);
+        freebitmap(packed);
+    }
+    secrettofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t i = 0; i < k; i++) {
         free(filepaths[i]);
         freebitmap(shadows[i]);
     }
@@ -639,29 +1861,862 @@ distributeimage(const char *dir, const char *imgpath, uint16_t k, uint16_t n, ui
     free(shadows);
 }
 
+/* Only the headers are read for now */
 void
-recoverimage(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k) {
-    Bitmap **shadows = xmalloc(sizeof(*shadows) * k);
+openshadowfile(Shadowfile *s, const char *filename) {
+    s->fp        = xfopen(filename, "r");
+    s->container = containerformat;
+    s->buf       = NULL;
+    s->bufsize   = 0;
+
+    if (s->container) {
+        uint8_t buf[SHD_HEADER_SIZE];
+        SHDheader h;
+
+        size_t len = fread(buf, 1, sizeof(buf), s->fp);
+        xfseek(s->fp, 0, SEEK_END);
+        if (!readshdheader(&h, buf, len, ftell(s->fp)))
+            die("%s: not a shadow container\n", filename);
+        s->seed   = h.seed;
+        s->number = h.shadownumber;
+        s->offset = h.offset;
+    } else {
+        Bitmap b;
+
+        if (!readheaders(&b, s->fp))
+            die("%s: not a supported BMP file\n", filename);
+        s->seed     = b.bmpheader.unused1;
+        s->number   = b.bmpheader.unused2;
+        s->offset   = b.bmpheader.offset;
+        s->stride   = bmpstride(&b);
+        s->rowbytes = legacylayout ? s->stride : bmprowbytes(&b);
+    }
+}
 
-    char **filepaths = getshadowfilenames(dir, k, width * height);
-    for (size_t i = 0; i < k; i++) {
-        Bitmap *bp = bmpfromfile(filepaths[i]);
-        shadows[i] = retrieveshadow(bp, width, height, k);
-        freebitmap(bp);
+void
+closeshadowfile(Shadowfile *s) {
+    xfclose(s->fp);
+    free(s->buf);
+}
+
+/* Reads count shadow bytes starting from the first one. For covers, only the
+ * 8 * count bytes carrying them are read, a row of the cover at a time */
+void
+readshadowbytes(Shadowfile *s, size_t first, size_t count, uint8_t *out) {
+    int fd    = fileno(s->fp);
+    size_t c0 = first * 8;
+    size_t c1 = (first + count) * 8;
+
+    if (s->container) {
+        xpread(fd, out, count, (off_t) s->offset + first);
+        return;
+    }
+
+    if (s->bufsize < c1 - c0) {
+        free(s->buf);
+        s->bufsize = c1 - c0;
+        s->buf     = xmalloc(s->bufsize);
+    }
+    for (size_t c = c0; c < c1;) {
+        size_t row = c / s->rowbytes;
+        size_t col = c % s->rowbytes;
+        size_t len = s->rowbytes - col < c1 - c ? s->rowbytes - col : c1 - c;
+
+        xpread(fd, s->buf + (c - c0), len, (off_t) s->offset + row * s->stride + col);
+        c += len;
     }
 
-    Bitmap *bmp = revealsecret(shadows, width, height, k);
-    bmptofile(bmp, filename);
+    for (size_t i = 0; i < count; i++) {
+        uint8_t byte = 0;
+        for (size_t j = 0; j < 8; j++)
+            byte = byte << 1 | (s->buf[i * 8 + j] & 0x01);
+        out[i] = byte;
+    }
+}
+
+/* Writes a preview of the secret to previewfile, at most PREVIEW_SIZE pixels
+ * on each side, before anything else is done. Only the blocks holding one
+ * pixel in every step x step square are solved, which needs just a few bytes
+ * from each shadow, so it's ready long before a full recovery */
+void
+previewsecret(char **filepaths, uint32_t width, int32_t height, uint16_t k) {
+    uint32_t h       = abs(height);
+    size_t rowlen    = legacylayout ? calculatepixelarraysize(width, 1) : width;
+    uint32_t step    = ((width > h ? width : h) + PREVIEW_SIZE - 1) / PREVIEW_SIZE;
+    Shadowfile *files = xmalloc(sizeof(*files) * k);
+    uint16_t *xs      = xmalloc(sizeof(*xs) * k);
+    uint8_t *ys       = xmalloc(k);
+    uint8_t *block    = xmalloc(k);
+
+    for (size_t j = 0; j < k; j++) {
+        openshadowfile(&files[j], filepaths[j]);
+        xs[j] = files[j].number;
+    }
+    uint32_t *inv = vandermondeinverse(xs, k);
+
+    uint32_t pw     = (width + step - 1) / step;
+    uint32_t ph     = (h + step - 1) / step;
+    Bitmap *bmp     = newbitmap(pw, ph, files[0].seed);
+    uint32_t stride = bmpstride(bmp);
+
+    for (uint32_t i = 0; i < ph; i++) {
+        uint8_t *row = bmp->imgpixels + (size_t) (ph - 1 - i) * stride;
+        for (uint32_t t = 0; t < pw; t++) {
+            /* pixels are shared bottom row first */
+            size_t p = (h - 1 - (size_t) i * step) * rowlen + (size_t) t * step;
+            for (size_t j = 0; j < k; j++)
+                readshadowbytes(&files[j], p / k, 1, &ys[j]);
+            combineblock(inv, ys, k, block);
+            row[t] = block[p % k];
+        }
+    }
+    clearpadding(bmp);
+    secrettofile(bmp, previewfile);
     freebitmap(bmp);
 
-    for (size_t i = 0; i < k; i++) {
+    for (size_t j = 0; j < k; j++)
+        closeshadowfile(&files[j]);
+    free(inv);
+    free(files);
+    free(xs);
+    free(ys);
+    free(block);
+}
+
+/* Weights of the k shadow values at xs making up the value, at x, of the
+ * polynomial they interpolate */
+void
+lagrangeweights(const uint16_t *xs, uint16_t k, uint16_t x, uint32_t *weights) {
+    for (size_t j = 0; j < k; j++) {
+        uint32_t num = 1;
+        uint32_t den = 1;
+        for (size_t m = 0; m < k; m++) {
+            if (m == j)
+                continue;
+            num = num * mod((int) x - xs[m], PRIME) % PRIME;
+            den = den * mod((int) xs[j] - xs[m], PRIME) % PRIME;
+        }
+        if (!den)
+            die("shadow number %d appears more than once\n", xs[j]);
+        weights[j] = num * modinv[den] % PRIME;
+    }
+}
+
+/* Makes count new shadows, numbered from first on, out of k existing ones in
+ * dir. Each new shadow byte is the polynomial through the k old ones evaluated
+ * at the new number, i.e. a weighted sum of them, with the weights worked out
+ * once. The old shadows are read a tile at a time and the secret itself is
+ * never formed */
+void
+extendshadows(const char *dir, const char *coversdir, uint32_t width, int32_t height, uint16_t k, uint16_t first, uint16_t count) {
+    if (compression) {
+        width  = packedsize(dir, k, width, height);
+        height = 1;
+    }
+    uint32_t pixels   = secretpixels(width, height);
+    uint32_t size     = shadowsize(pixels, k);
+    Shadowfile *files = xmalloc(sizeof(*files) * k);
+    uint8_t **in      = xmalloc(sizeof(*in) * k);
+    uint16_t *xs      = xmalloc(sizeof(*xs) * k);
+    uint32_t *weights = xmalloc(sizeof(*weights) * k * count);
+    Cursor *cursors   = NULL;
+    char **coverpaths = NULL;
+    char **filepaths;
+    Bitmap **out;
+
+    if (!first || first + count - 1 >= PRIME)
+        die("new shadow numbers must be between 1 and %d\n", PRIME - 1);
+
+    if (containerformat)
+        filepaths = getcontainerfilenames(dir, k, pixels);
+    else
+        filepaths = getshadowfilenames(dir, k, pixels);
+
+    for (size_t j = 0; j < k; j++) {
+        openshadowfile(&files[j], filepaths[j]);
+        xs[j] = files[j].number % PRIME;
+        in[j] = xmalloc(TILE_PIXELS);
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < k; j++)
+            if (xs[j] == first + i)
+                die("shadow %d already exists in %s\n", xs[j], dir);
+        lagrangeweights(xs, k, first + i, weights + i * k);
+    }
+
+    if (containerformat) {
+        uint32_t w;
+        int32_t h;
+        findclosestpair(size, &w, &h);
+        out = xmalloc(sizeof(*out) * count);
+        for (size_t i = 0; i < count; i++)
+            out[i] = newshadow(w, h, files[0].seed, first + i);
+    } else {
+        coverpaths = getbmpfilenames(coversdir, k, count, pixels);
+        out        = readcovers(coverpaths, count);
+        cursors    = xmalloc(sizeof(*cursors) * count);
+        for (size_t i = 0; i < count; i++) {
+            out[i]->bmpheader.unused1 = files[0].seed;
+            out[i]->bmpheader.unused2 = first + i;
+            putbmpheader(out[i], out[i]->raw);
+            initcursor(&cursors[i], out[i]);
+        }
+    }
+
+    for (uint32_t b = 0; b < size; b += TILE_PIXELS) {
+        uint32_t len = size - b < TILE_PIXELS ? size - b : TILE_PIXELS;
+
+        for (size_t j = 0; j < k; j++)
+            readshadowbytes(&files[j], b, len, in[j]);
+
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t *w = weights + i * k;
+            for (uint32_t t = 0; t < len; t++) {
+                uint32_t sum = 0; /* at most 250 * 250 * 65535 < 2^32 */
+                for (size_t j = 0; j < k; j++)
+                    sum += w[j] * in[j][t];
+                if (containerformat)
+                    out[i]->imgpixels[b + t] = sum % PRIME;
+                else
+                    hidebyte(&cursors[i], sum % PRIME);
+            }
+        }
+    }
+
+    if (containerformat) {
+        for (size_t i = 0; i < count; i++) {
+            shadowtocontainer(out[i], k, width, height);
+            freebitmap(out[i]);
+        }
+        free(out);
+    } else {
+        Aio *aio = aioinit(IO_DEPTH);
+        writecovers(aio, out, count, NULL);
+        aiofree(aio);
+        for (size_t i = 0; i < count; i++)
+            free(coverpaths[i]);
+        free(coverpaths);
+        free(cursors);
+        free(out);
+    }
+
+    for (size_t j = 0; j < k; j++) {
+        closeshadowfile(&files[j]);
+        free(filepaths[j]);
+        free(in[j]);
+    }
+    free(filepaths);
+    free(files);
+    free(in);
+    free(xs);
+    free(weights);
+}
+
+/* parses the x,y,w,h argument of --region */
+void
+parseregion(const char *arg, uint32_t region[static 4]) {
+    const char *s = arg;
+    char *end;
+
+    for (size_t i = 0; i < 4; i++) {
+        long l = strtol(s, &end, 10);
+        if (end == s || l < 0 || l > INT32_MAX || *end != (i < 3 ? ',' : '\0'))
+            die("--region must be x,y,w,h; was %s\n", arg);
+        region[i] = l;
+        s = end + 1;
+    }
+}
+
+/* Reveals just the w x h rectangle at x,y (from the top left corner) of the
+ * width x height secret. For each of its rows only the blocks it touches are
+ * solved, and only the shadow bytes those need are read from the k files */
+void
+recoverregion(const char *dir, const char *filename, uint32_t width, int32_t height, uint16_t k, const uint32_t region[static 4]) {
+    uint32_t x = region[0], y = region[1], w = region[2], h = region[3];
+    size_t rowlen    = legacylayout ? calculatepixelarraysize(width, 1) : width;
+    size_t maxblocks = (w - 1)/k + 2;
+    char **filepaths;
+
+    if (!w || !h || (uint64_t) x + w > width || (uint64_t) y + h > (uint32_t) abs(height))
+        die("the region must lie within the %ux%d image\n", width, abs(height));
+
+    if (containerformat)
+        filepaths = getcontainerfilenames(dir, k, secretpixels(width, height));
+    else
+        filepaths = getshadowfilenames(dir, k, secretpixels(width, height));
+    if (previewfile)
+        previewsecret(filepaths, width, height, k);
+
+    Shadowfile *files = xmalloc(sizeof(*files) * k);
+    uint8_t **bytes   = xmalloc(sizeof(*bytes) * k);
+    uint16_t *xs      = xmalloc(sizeof(*xs) * k);
+    uint8_t *ys       = xmalloc(k);
+    uint8_t *block    = xmalloc(k);
+
+    for (size_t j = 0; j < k; j++) {
+        openshadowfile(&files[j], filepaths[j]);
+        xs[j]    = files[j].number;
+        bytes[j] = xmalloc(maxblocks);
+    }
+    uint32_t *inv = vandermondeinverse(xs, k);
+
+    Bitmap *bmp     = newbitmap(w, h, files[0].seed);
+    uint32_t stride = bmpstride(bmp);
+
+    for (uint32_t i = 0; i < h; i++) {
+        /* pixels are shared bottom row first */
+        size_t p0 = (abs(height) - 1 - (y + i)) * rowlen + x;
+        size_t b0 = p0 / k;
+        size_t b1 = (p0 + w - 1) / k;
+        uint8_t *row = bmp->imgpixels + (size_t) (h - 1 - i) * stride;
+
+        for (size_t j = 0; j < k; j++)
+            readshadowbytes(&files[j], b0, b1 - b0 + 1, bytes[j]);
+
+        for (size_t b = b0; b <= b1; b++) {
+            for (size_t j = 0; j < k; j++)
+                ys[j] = bytes[j][b - b0];
+            combineblock(inv, ys, k, block);
+            for (size_t t = 0; t < k; t++) {
+                size_t p = b * k + t;
+                if (p >= p0 && p < p0 + w)
+                    row[p - p0] = block[t];
+            }
+        }
+    }
+    clearpadding(bmp);
+    secrettofile(bmp, filename);
+    freebitmap(bmp);
+
+    for (size_t j = 0; j < k; j++) {
+        closeshadowfile(&files[j]);
+        free(bytes[j]);
+        free(filepaths[j]);
+    }
+    free(inv);
+    free(filepaths);
+    free(files);
+    free(bytes);
+    free(xs);
+    free(ys);
+    free(block);
+}
+
+/* whether fi is a shadow at all, of whatever secret, in the format in use */
+bool
+isanyshadow(const Fileinfo *fi, uint16_t k, uint32_t secretsize) {
+    (void) k;
+    (void) secretsize;
+
+    return containerformat ? fi->container : fi->bmp && fi->number;
+}
+
+/* Counts how many of the sampled blocks in ys, m shadow bytes each, don't lie
+ * on a single polynomial, leaving out shadow skip (m to leave none out). The
+ * first k shadows left are solved, and the rest checked against them */
+size_t
+countdisagreements(const uint8_t *ys, const uint16_t *xs, size_t m, size_t skip, uint16_t k, size_t samples) {
+    size_t *ref    = xmalloc(sizeof(*ref) * k);
+    uint16_t *refx = xmalloc(sizeof(*refx) * k);
+    uint8_t *refy  = xmalloc(k);
+    uint8_t *block = xmalloc(k);
+    size_t bad     = 0;
+    size_t last    = 0;
+
+    for (size_t i = 0, j = 0; j < k; i++) {
+        if (i == skip)
+            continue;
+        ref[j]    = i;
+        refx[j++] = xs[i];
+        last      = i;
+    }
+    uint32_t *inv = vandermondeinverse(refx, k);
+
+    for (size_t s = 0; s < samples; s++) {
+        const uint8_t *y = ys + s * m;
+        for (size_t j = 0; j < k; j++)
+            refy[j] = y[ref[j]];
+        combineblock(inv, refy, k, block);
+        for (size_t i = last + 1; i < m; i++) {
+            if (i != skip && generatepixel(block, k - 1, xs[i]) != y[i]) {
+                bad++;
+                break;
+            }
+        }
+    }
+    free(ref);
+    free(refx);
+    free(refy);
+    free(block);
+    free(inv);
+
+    return bad;
+}
+
+/* Checks the shadows in dir hold a width x height secret, without recovering
+ * it. Every shadow there is listed, and must fit the secret and k; their
+ * numbers must be distinct and their keys the same. VERIFY_SAMPLES blocks
+ * picked at random must then lie on a single polynomial across all of them,
+ * which only needs a byte per sample from each file, whatever the size of the
+ * secret. When they don't and there are shadows to spare, the one whose
+ * removal leaves the rest agreeing is named, if there's exactly one. Returns
+ * the exit status */
+int
+verifyshadows(const char *dir, uint32_t width, int32_t height, uint16_t k) {
+    struct timespec start, end;
+    bool ok       = true;
+    bool solvable = true; /* whether the blocks can be sampled */
+    size_t total;
+    size_t m = 0;
+    Fileinfo fi;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (compression) {
+        width  = packedsize(dir, k, width, height);
+        height = 1;
+    }
+    uint32_t pixels   = secretpixels(width, height);
+    uint32_t size     = shadowsize(pixels, k);
+    char **filepaths  = findvalidfilenames(dir, k, countfiles(dir), isanyshadow, pixels, &total);
+    Shadowfile *files = xmalloc(sizeof(*files) * (total ? total : 1));
+    uint16_t *xs      = xmalloc(sizeof(*xs) * (total ? total : 1));
+
+    printf("%s: %zu shadows, of %u bytes for a %ux%d secret\n", dir, total, size, width, abs(height));
+    for (size_t i = 0; i < total; i++) {
+        if (!getfileinfo(filepaths[i], &fi))
+            die("fopen: couldn't open %s\n", filepaths[i]);
+        if (!(containerformat ? isvalidcontainer : isvalidshadow)(&fi, k, pixels)) {
+            printf("  %s: shadow %d, but not of this secret with k = %d\n", filepaths[i],
+                    containerformat ? fi.h.shadownumber : fi.number, k);
+            free(filepaths[i]);
+            ok = false;
+            continue;
+        }
+        filepaths[m] = filepaths[i];
+        openshadowfile(&files[m], filepaths[m]);
+        xs[m] = files[m].number % PRIME;
+        printf("  %s: shadow %d, key %d\n", filepaths[m], files[m].number, files[m].seed);
+        if (!xs[m]) {
+            printf("  %s: shadow numbers can't be multiples of %d\n", filepaths[m], PRIME);
+            ok = solvable = false;
+        }
+        if (files[m].seed != files[0].seed) {
+            printf("  %s: key doesn't match that of %s\n", filepaths[m], filepaths[0]);
+            ok = false;
+        }
+        for (size_t j = 0; j < m; j++) {
+            if (xs[m] == xs[j]) {
+                printf("  %s: same shadow number as %s\n", filepaths[m], filepaths[j]);
+                ok = solvable = false;
+            }
+        }
+        m++;
+    }
+    if (m < k) {
+        printf("not enough shadows for k = %d\n", k);
+        ok = solvable = false;
+    }
+
+    if (solvable) {
+        size_t samples = size < VERIFY_SAMPLES ? size : VERIFY_SAMPLES;
+        uint8_t *ys    = xmalloc(samples * m);
+
+        srand(time(NULL));
+        for (size_t s = 0; s < samples; s++) {
+            size_t b = samples == size ? s : (size_t) randint(size - 1);
+            for (size_t i = 0; i < m; i++)
+                readshadowbytes(&files[i], b, 1, &ys[s * m + i]);
+        }
+
+        printf("%zu blocks sampled", samples);
+        if (m == k) {
+            printf(", with no shadows beyond k to check them against\n");
+        } else {
+            size_t bad = countdisagreements(ys, xs, m, m, k, samples);
+            printf(" across %zu shadows\n", m);
+            if (bad) {
+                size_t culprit = m;
+                size_t found   = 0;
+                printf("  the set is inconsistent: %zu blocks don't lie on one polynomial\n", bad);
+                for (size_t i = 0; m > (size_t) k + 1 && i < m; i++) {
+                    if (!countdisagreements(ys, xs, m, i, k, samples)) {
+                        culprit = i;
+                        found++;
+                    }
+                }
+                if (found == 1)
+                    printf("  all the others agree without %s\n", filepaths[culprit]);
+                ok = false;
+            }
+        }
+        free(ys);
+    }
+
+    for (size_t i = 0; i < m; i++) {
+        closeshadowfile(&files[i]);
         free(filepaths[i]);
-        freebitmap(shadows[i]);
     }
     free(filepaths);
-    free(shadows);
+    free(files);
+    free(xs);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%s in %.3f ms\n", ok ? "consistent" : "inconsistent",
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+cmpname(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* The frames of --sequence: the regular files in path, by name, if it's a
+ * directory, or else the file names it lists, one per line */
+char **
+readsequence(const char *path, size_t *count) {
+    char filepath[PATH_MAX] = {0};
+    size_t capacity = 64;
+    char **names    = xmalloc(sizeof(*names) * capacity);
+    DIR *dp         = NULL;
+    FILE *fp        = NULL;
+    struct dirent *d;
+
+    if (isdirectory(path))
+        dp = xopendir(path);
+    else
+        fp = xfopen(path, "r");
+
+    for (*count = 0;;) {
+        if (dp) {
+            if (!(d = readdir(dp)))
+                break;
+            if (d->d_type != DT_REG)
+                continue;
+            xsnprintf(filepath, PATH_MAX, "%.*s/%.*s", DIR_MAX, path, NAME_MAX, d->d_name);
+        } else {
+            if (!fgets(filepath, PATH_MAX, fp))
+                break;
+            filepath[strcspn(filepath, "\r\n")] = '\0';
+            if (!*filepath)
+                continue;
+        }
+        if (*count == capacity) {
+            char **grown = realloc(names, sizeof(*names) * 2 * capacity);
+            if (!grown)
+                die("realloc: couldn't allocate %zu names\n", 2 * capacity);
+            names     = grown;
+            capacity *= 2;
+        }
+        names[(*count)++] = xstrdup(filepath);
+    }
+
+    if (dp) {
+        xclosedir(dp);
+        qsort(names, *count, sizeof(*names), cmpname);
+    } else {
+        xfclose(fp);
+    }
+
+    return names;
+}
+
+/* Makes the directory the shadows of the frame at index go in, frame<number>
+ * in the --out directory, and writes its path to buf. Returns its length */
+size_t
+framedir(char *buf, size_t size, const Sequence *s, size_t index) {
+    const char *out = outtemplate ? outtemplate : ".";
+    bool slash      = out[strlen(out) - 1] != '/';
+    size_t len      = xsnprintf(buf, size, "%s%sframe%0*zu", out, slash ? "/" : "", s->digits, index + 1);
+
+    if (mkdir(buf, 0777) && errno != EEXIST)
+        die("mkdir: couldn't make %s: %s\n", buf, strerror(errno));
+
+    return len;
+}
+
+/* A copy of cover with the first size bytes of shadow hidden in it, as
+ * formandhideshadows() does */
+Bitmap *
+hideincopy(const Bitmap *cover, const Bitmap *shadow, uint32_t size) {
+    uint8_t *raw = xpixelalloc(cover->rawsize, 0);
+    Cursor c;
+
+    memcpy(raw, cover->raw, cover->rawsize);
+    Bitmap *bp = bmpfrombuffer("cover", raw, cover->rawsize);
+    bp->bmpheader.unused1 = shadow->bmpheader.unused1;
+    bp->bmpheader.unused2 = shadow->bmpheader.unused2;
+    putbmpheader(bp, bp->raw);
+
+    initcursor(&c, bp);
+    for (uint32_t i = 0; i < size; i++)
+        hidebyte(&c, shadow->imgpixels[i]);
+
+    return bp;
 }
 
+/* First stage of --sequence: reads the next frame not taken by another thread
+ * and forms its shadows, until there are none left */
+void *
+formframes(void *arg) {
+    Sequence *s = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        size_t i = s->next < s->count ? s->next++ : s->count;
+        pthread_mutex_unlock(&s->lock);
+        if (i == s->count)
+            return NULL;
+
+        Bitmap *bmp = secretfromfile(s->secrets[i], s->width, s->height);
+        if (bmp->dibheader.depth != BITS_PER_PIXEL)
+            die("%s: the secret must be an 8-bit greyscale image\n", s->secrets[i]);
+        if (compression) {
+            Bitmap *packed = packsecret(bmp);
+            freebitmap(bmp);
+            bmp = packed;
+        }
+        if (secretpixels(bmp->dibheader.width, bmp->dibheader.height) > s->maxpixels)
+            die("%s: larger than the -w by -h frames the covers were picked for\n", s->secrets[i]);
+
+        Frame *f   = xmalloc(sizeof(*f));
+        f->index   = i;
+        f->width   = bmp->dibheader.width;
+        f->height  = bmp->dibheader.height;
+        truncategrayscale(bmp);
+        f->shadows = formshadows(bmp, s->k, s->n, s->seed);
+        freebitmap(bmp);
+        queuepush(s->formed, f);
+    }
+}
+
+/* Second stage of --sequence: hides the shadows of each formed frame in copies
+ * of the covers, written through an Aio of its own, or puts them in containers */
+void *
+hideframes(void *arg) {
+    Sequence *s = arg;
+    char path[PATH_MAX] = {0};
+    Aio *aio     = s->covers ? aioinit(IO_DEPTH) : NULL;
+    Bitmap **out = xmalloc(sizeof(*out) * s->n);
+    Frame *f;
+
+    if (aio) {
+        pthread_mutex_lock(&s->lock);
+        s->engine = aioengine(aio);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    while ((f = queuepop(s->formed))) {
+        size_t len    = framedir(path, PATH_MAX, s, f->index);
+        uint32_t size = shadowsize(secretpixels(f->width, f->height), s->k);
+
+        for (size_t i = 0; i < s->n; i++) {
+            if (s->covers) {
+                out[i] = hideincopy(s->covers[i], f->shadows[i], size);
+            } else {
+                xsnprintf(path + len, PATH_MAX - len, "/shadow%zu.shd", i + 1);
+                writecontainer(f->shadows[i], s->k, f->width, f->height, path);
+            }
+            freebitmap(f->shadows[i]);
+        }
+        if (s->covers)
+            writecovers(aio, out, s->n, path);
+        free(f->shadows);
+        free(f);
+    }
+    if (aio)
+        aiofree(aio);
+    free(out);
+
+    return NULL;
+}
+
+/* Distributes every frame listed by frames (see readsequence()) into a
+ * directory of its own. Covers are picked and read once, to fit a -w by -h
+ * secret, and used for all the frames. Half the processors form shadows and
+ * the other half hide and write them, with at most QUEUE_FRAMES frames waiting
+ * in between, so reading secrets, the arithmetic and writing all overlap */
+void
+distributesequence(const char *dir, const char *frames, uint32_t width, int32_t height, uint16_t k, uint16_t n, uint16_t seed) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec start, end;
+    Sequence s =
+        { .width  = width
+        , .height = height
+        , .k      = k
+        , .n      = n
+        , .seed   = seed
+        };
+
+    if (outtemplate && !isdirectory(outtemplate))
+        die("--out must be a directory with --sequence\n");
+    s.secrets = readsequence(frames, &s.count);
+    if (!s.count)
+        die("%s: no frames to share\n", frames);
+    for (size_t c = s.count; c; c /= 10)
+        s.digits++;
+    /* a frame that doesn't pack is stored whole, after the header */
+    s.maxpixels = secretpixels(width, height) + (compression ? PACK_HEADER : 0);
+
+    if (!containerformat) {
+        char **filepaths = getbmpfilenames(dir, k, n, s.maxpixels);
+        s.covers = readcovers(filepaths, n);
+        for (size_t i = 0; i < n; i++)
+            free(filepaths[i]);
+        free(filepaths);
+    }
+
+    size_t formers = cpus > 1 ? cpus / 2 : 1;
+    size_t hiders  = cpus > 1 ? cpus - formers : 1;
+    if (formers > s.count)
+        formers = s.count;
+    if (hiders > s.count)
+        hiders = s.count;
+    pthread_t *threads = xmalloc(sizeof(*threads) * (formers + hiders));
+    s.formed = queueinit(QUEUE_FRAMES);
+    pthread_mutex_init(&s.lock, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < formers + hiders; i++)
+        if (pthread_create(&threads[i], NULL, i < formers ? formframes : hideframes, &s))
+            die("--sequence: couldn't create thread\n");
+    for (size_t i = 0; i < formers; i++)
+        pthread_join(threads[i], NULL);
+    queueclose(s.formed);
+    for (size_t i = formers; i < formers + hiders; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%zu frames in %.3f s, %.2f frames/s", s.count, secs, s.count / secs);
+    if (s.engine)
+        printf(", written through %s", s.engine);
+    putchar('\n');
+
+    pthread_mutex_destroy(&s.lock);
+    queuefree(s.formed);
+    free(threads);
+    for (size_t i = 0; s.covers && i < n; i++)
+        freebitmap(s.covers[i]);
+    free(s.covers);
+    for (size_t i = 0; i < s.count; i++)
+        free(s.secrets[i]);
+    free(s.secrets);
+}
+
+/* The secret as a single row to share instead: PACK_HEADER bytes with the
+ * method and the length of what follows (four base 251 digits, least
+ * significant first), and then the pixels, bottom row first, packed by
+ * packpixels() or just stored if they don't pack */
+Bitmap *
+packsecret(const Bitmap *bp) {
+    uint32_t width = bp->dibheader.width;
+    uint32_t pixels = width * bmpheight(bp);
+    size_t len;
+    Cursor c;
+
+    initsecretcursor(&c, bp);
+    uint8_t *packed = packpixels(c.row, width, bmpheight(bp), c.stride, &len);
+    uint8_t method  = packed ? PACK_DELTA : PACK_STORED;
+    if (!packed)
+        len = pixels;
+
+    Bitmap *p = newbitmap(PACK_HEADER + len, 1, bp->bmpheader.unused1);
+    uint8_t *out = p->imgpixels;
+
+    out[0] = method;
+    for (size_t i = 1, l = len; i < PACK_HEADER; i++, l /= PRIME)
+        out[i] = l % PRIME;
+    if (packed) {
+        memcpy(out + PACK_HEADER, packed, len);
+        free(packed);
+    } else {
+        for (uint32_t i = 0; i < pixels; i++)
+            out[PACK_HEADER + i] = *nextbyte(&c);
+        truncategrayscale(p);
+    }
+    clearpadding(p);
+
+    return p;
+}
+
+Bitmap *
+unpacksecret(const Bitmap *packed, uint32_t width, int32_t height) {
+    const uint8_t *in = packed->imgpixels;
+    Bitmap *bmp       = newbitmap(width, height, packed->bmpheader.unused1);
+    uint32_t pixels   = width * bmpheight(bmp);
+    uint32_t len      = 0;
+    Cursor c;
+
+    for (size_t i = PACK_HEADER; i-- > 1;)
+        len = len * PRIME + in[i];
+    if (PACK_HEADER + len > packed->dibheader.width)
+        die("the packed secret is corrupt\n");
+
+    initsecretcursor(&c, bmp);
+    if (in[0] == PACK_STORED && len == pixels) {
+        for (uint32_t i = 0; i < pixels; i++)
+            *nextbyte(&c) = in[PACK_HEADER + i];
+    } else if (in[0] != PACK_DELTA
+            || !unpackpixels(in + PACK_HEADER, len, c.row, width, bmpheight(bmp), c.stride)) {
+        die("the packed secret is corrupt, or isn't %ux%d\n", width, height);
+    }
+    clearpadding(bmp);
+
+    return bmp;
+}
+
+/* Length of the packed secret shared by the shadows in dir, worked out from
+ * the blocks holding its header */
+uint32_t
+packedsize(const char *dir, uint16_t k, uint32_t width, int32_t height) {
+    size_t blocks     = (PACK_HEADER + k - 1) / k;
+    Shadowfile *files = xmalloc(sizeof(*files) * k);
+    uint16_t *xs      = xmalloc(sizeof(*xs) * k);
+    uint8_t *ys       = xmalloc(k * blocks);
+    uint8_t *header   = xmalloc(k * blocks);
+    char **filepaths;
+
+    if (containerformat)
+        filepaths = getcontainerfilenames(dir, k, PACK_HEADER);
+    else
+        filepaths = getshadowfilenames(dir, k, PACK_HEADER);
+
+    for (size_t j = 0; j < k; j++) {
+        openshadowfile(&files[j], filepaths[j]);
+        xs[j] = files[j].number;
+        readshadowbytes(&files[j], 0, blocks, ys + j * blocks);
+    }
+    uint32_t *inv = vandermondeinverse(xs, k);
+    uint8_t *block = xmalloc(k);
+
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t j = 0; j < k; j++)
+            block[j] = ys[j * blocks + b];
+        combineblock(inv, block, k, header + b * k);
+    }
+
+    uint64_t len = 0;
+    for (size_t i = PACK_HEADER; i-- > 1;)
+        len = len * PRIME + header[i];
+    if (header[0] > PACK_DELTA || len > (uint64_t) width * abs(height))
+        die("the shadows in %s don't hold a packed %ux%d secret\n", dir, width, abs(height));
+
+    for (size_t j = 0; j < k; j++) {
+        closeshadowfile(&files[j]);
+        free(filepaths[j]);
+    }
+    free(filepaths);
+    free(files);
+    free(xs);
+    free(ys);
+    free(header);
+    free(block);
+    free(inv);
+
+    return PACK_HEADER + len;
+}
 
 void
 truncategrayscale(Bitmap *bp) {
@@ -702,19 +2757,22 @@ unpermutepixels(Bitmap *bp, uint16_t seed) {
 }
 
 /* uses coeff[0] to coeff[degree] to evaluate the corresponding
- * section polynomial and generate a pixel for a shadow image */
+ * section polynomial and generate a pixel for a shadow image. Horner's rule
+ * keeps every step within the field, whatever the degree */
 uint8_t
 generatepixel(const uint8_t *coeff, uint16_t degree, uint16_t value) {
-    intmax_t ret = 0;
+    uint32_t x   = value % PRIME;
+    uint32_t ret = 0;
 
-    for (size_t i = 0; i <= degree; i++)
-        ret += coeff[i] * pow(value, i);
+    for (size_t i = degree + 1; i-- > 0;)
+        ret = (ret * x + coeff[i]) % PRIME;
 
-    return ret % PRIME;
+    return ret;
 }
 
+/* a whole command line, run either by main() or by a --serve child */
 int
-main(int argc, char *argv[argc + 1]) {
+run(int argc, char *argv[argc + 1]) {
     bool dflag      = 0;
     bool rflag      = 0;
     bool kflag      = 0;
@@ -722,12 +2780,18 @@ main(int argc, char *argv[argc + 1]) {
     bool hflag      = 0;
     bool nflag      = 0;
     bool secretflag = 0;
+    bool regionflag = 0;
+    bool verify     = 0;
+    uint16_t extend = 0;
+    char *coversdir = 0;
+    uint32_t region[4];
     uint16_t seed   = DEFAULT_SEED;
     uint16_t k      = 0;
     uint16_t n      = 0;
     uint32_t width  = 0;
     int32_t height  = 0;
     char *filename  = 0;
+    char *sequence  = 0;
     char *dir       = "./";
     char *endptr;
 
@@ -799,6 +2863,53 @@ main(int argc, char *argv[argc + 1]) {
             } else {
                 usage();
             }
+        } else if (strcmp(argv[i], "--region") == 0) {
+            regionflag = 1;
+            if (i + 1 < argc)
+                parseregion(argv[++i], region);
+            else
+                usage();
+        } else if (strcmp(argv[i], "--preview") == 0) {
+            if (i + 1 < argc)
+                previewfile = argv[++i];
+            else
+                usage();
+        } else if (strcmp(argv[i], "--extend") == 0) {
+            if (i + 1 < argc) {
+                long int l = xstrtol(argv[++i], &endptr, 10);
+                if (0 < l && l < PRIME)
+                    extend = l;
+                else
+                    die("--extend takes the first new shadow number, 1 to %d; was %d\n", PRIME - 1, l);
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[i], "--covers") == 0) {
+            if (i + 1 < argc)
+                coversdir = argv[++i];
+            else
+                usage();
+        } else if (strcmp(argv[i], "--sequence") == 0) {
+            if (i + 1 < argc)
+                sequence = argv[++i];
+            else
+                usage();
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compression = 1;
+        } else if (strcmp(argv[i], "--legacy") == 0) {
+            legacylayout = 1;
+        } else if (strcmp(argv[i], "--container") == 0) {
+            containerformat = 1;
+        } else if (strcmp(argv[i], "--odirect") == 0) {
+            containerformat = 1;
+            directio = 1;
+        } else if (strcmp(argv[i], "--out") == 0) {
+            if (i + 1 < argc && isvalidtemplate(argv[i + 1]))
+                outtemplate = argv[++i];
+            else
+                die("--out needs a directory, or a file name with a single %%d\n");
         } else if (strcmp(argv[i], "--dir") == 0) {
             if (i + 1 < argc) {
                 dir = argv[++i];
@@ -810,23 +2921,68 @@ main(int argc, char *argv[argc + 1]) {
         }
     }
 
-    if (!(dflag || rflag) || !secretflag || !kflag)
+    if (!(dflag || rflag || extend || verify) || !(secretflag || sequence || extend || verify) || !kflag)
         usage();
-    if ((rflag && !(wflag && hflag)) || !width || !height)
+    if (((rflag || extend || verify) && !(wflag && hflag)) || !width || !height)
         die("specify a positive width and height with -w -h for the revealed image\n");
+    if (verify && (dflag || rflag || extend))
+        die("can't use --verify along with -d, -r or --extend\n");
+    if (verify && k < 2)
+        die("k must be at least 2\n");
 
+    if (!nflag && ((containerformat && dflag) || extend))
+        die("specify the amount of shadows to make with -n\n");
     if (!nflag)
         n = countfiles(dir);
 
-    if (k > n || k < 2 || n < 2)
+    /* --verify reports however many shadows there are */
+    if (!verify && (extend ? k < 2 || !n : k > n || k < 2 || n < 2))
         die("k and n must be: 2 <= k <= n\n");
     if (dflag && rflag)
         die("can't use -d and -r flags simultaneously\n");
-
-    if (dflag)
-        distributeimage(dir, filename, k, n, seed);
+    if (extend && (dflag || rflag))
+        die("can't use --extend along with -d or -r\n");
+    if (extend && !containerformat && !coversdir)
+        die("specify where the covers for the new shadows are with --covers\n");
+
+    if (sequence && (!dflag || secretflag))
+        die("--sequence takes the place of --secret, and only with -d\n");
+    if (regionflag && !rflag)
+        die("--region only makes sense with -r\n");
+    if (previewfile && !rflag)
+        die("--preview only makes sense with -r\n");
+    if (compression && (legacylayout || regionflag || previewfile))
+        die("--compress can't be used with --legacy, --region or --preview\n");
+
+    if (verify)
+        return verifyshadows(dir, width, height, k);
+    if (extend)
+        extendshadows(dir, coversdir, width, height, k, extend, n);
+    else if (sequence)
+        distributesequence(dir, sequence, width, height, k, n, seed);
+    else if (dflag)
+        distributeimage(dir, filename, width, height, k, n, seed);
+    else if (regionflag)
+        recoverregion(dir, filename, width, height, k, region);
     else if (rflag)
         recoverimage(dir, filename, width, height, k);
 
     return EXIT_SUCCESS;
 }
+
+int
+main(int argc, char *argv[argc + 1]) {
+    argv0 = argv[0];
+
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        pthread_atfork(lockindex, unlockindex, unlockindex);
+        serve(argv[2], warmindex, run);
+    }
+    if (argc > 2 && strcmp(argv[1], "--connect") == 0) {
+        const char *path = argv[2];
+        argv[2] = argv[0]; /* the command line run is the rest */
+        return connectserver(path, argc - 2, argv + 2);
+    }
+
+    return run(argc, argv);
+}
@@ -0,0 +1,127 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include "pack.h"
+#include "util.h"
+
+#define ESCAPE     249 /* followed by the zigzagged residual minus ESCAPE */
+#define RUN        250 /* followed by the length of a run of zero residuals */
+#define MIN_RUN    3   /* shorter runs are cheaper as literal zeros */
+#define RUN_DIGITS 125 /* run lengths are written in base 125; a digit of 125
+                        * or more means more digits follow */
+
+static size_t putrun(uint8_t *out, size_t n, size_t max, uint32_t run);
+
+/* writes a run of zero residuals, or as much of it as fits before max */
+size_t
+putrun(uint8_t *out, size_t n, size_t max, uint32_t run) {
+    if (run < MIN_RUN) {
+        while (run-- > 0 && n < max)
+            out[n++] = 0;
+        return n;
+    }
+    if (n < max)
+        out[n++] = RUN;
+    for (run -= MIN_RUN; run >= RUN_DIGITS && n < max; run /= RUN_DIGITS)
+        out[n++] = RUN_DIGITS + run % RUN_DIGITS;
+    if (n < max)
+        out[n++] = run;
+
+    return n;
+}
+
+/* Each pixel is predicted by the one to its left, or the one above for the
+ * first of a row, and the residual (mod 256) is written zigzagged, so small
+ * ones of either sign become small symbols. Runs of zero residuals, which is
+ * most of a scanned page, become a RUN symbol and a length. Returns NULL if
+ * the result would be no smaller than the pixels themselves */
+uint8_t *
+packpixels(const uint8_t *pixels, uint32_t width, uint32_t height, ptrdiff_t stride, size_t *len) {
+    size_t max   = (size_t) width * height;
+    uint8_t *out = xmalloc(max ? max : 1);
+    size_t n     = 0;
+    uint32_t run = 0;
+
+    for (uint32_t y = 0; y < height && n < max; y++) {
+        const uint8_t *row = pixels + y * stride;
+        for (uint32_t x = 0; x < width && n < max; x++) {
+            uint8_t pred = x ? row[x-1] : y ? row[-stride] : 0;
+            int r        = (int8_t) (uint8_t) (row[x] - pred);
+            unsigned z   = r >= 0 ? 2 * r : -2 * r - 1;
+
+            if (!z) {
+                run++;
+                continue;
+            }
+            n = putrun(out, n, max, run);
+            run = 0;
+            if (z < ESCAPE) {
+                if (n < max)
+                    out[n++] = z;
+            } else if (n + 1 < max) {
+                out[n++] = ESCAPE;
+                out[n++] = z - ESCAPE;
+            } else {
+                n = max;
+            }
+        }
+    }
+    n = putrun(out, n, max, run);
+
+    if (n >= max) {
+        free(out);
+        return NULL;
+    }
+    *len = n;
+
+    return out;
+}
+
+/* Returns false if in isn't exactly width x height packed pixels */
+bool
+unpackpixels(const uint8_t *in, size_t len, uint8_t *pixels, uint32_t width, uint32_t height, ptrdiff_t stride) {
+    size_t total = (size_t) width * height;
+    size_t i     = 0;
+    size_t run   = 0;
+
+    for (size_t p = 0; p < total; p++) {
+        uint32_t x   = p % width;
+        uint32_t y   = p / width;
+        uint8_t *row = pixels + y * stride;
+        uint8_t pred = x ? row[x-1] : y ? row[-stride] : 0;
+        unsigned z   = 0;
+
+        if (run) {
+            run--;
+        } else {
+            if (i >= len)
+                return false;
+            z = in[i++];
+            if (z == ESCAPE) {
+                if (i >= len || in[i] > 255 - ESCAPE)
+                    return false;
+                z += in[i++];
+            } else if (z == RUN) {
+                size_t scale = 1;
+                run = MIN_RUN;
+                do {
+                    if (i >= len || scale > total)
+                        return false;
+                    run += (in[i] % RUN_DIGITS) * scale;
+                    scale *= RUN_DIGITS;
+                } while (in[i++] >= RUN_DIGITS);
+                if (run > total - p)
+                    return false;
+                run--;
+                z = 0;
+            }
+        }
+        row[x] = pred + (z & 1 ? -(int) (z + 1) / 2 : (int) z / 2);
+    }
+
+    return i == len && !run;
+}
@@ -0,0 +1,5 @@
+/* Lossless coding of greyscale pixels into symbols no larger than 250, so they
+ * survive being shared over GF(251) as they are. Rows start at pixels and are
+ * stride bytes apart, which may be negative */
+uint8_t *packpixels(const uint8_t *pixels, uint32_t width, uint32_t height, ptrdiff_t stride, size_t *len);
+bool    unpackpixels(const uint8_t *in, size_t len, uint8_t *pixels, uint32_t width, uint32_t height, ptrdiff_t stride);
@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+
+#include "queue.h"
+#include "util.h"
+
+struct Queue {
+    void            **items; /* ring of capacity slots */
+    size_t          capacity;
+    size_t          head;    /* next slot to pop */
+    size_t          count;
+    bool            closed;
+    pthread_mutex_t lock;
+    pthread_cond_t  notempty;
+    pthread_cond_t  notfull;
+};
+
+Queue *
+queueinit(size_t capacity) {
+    Queue *q = xmalloc(sizeof(*q));
+
+    q->items    = xmalloc(sizeof(*q->items) * capacity);
+    q->capacity = capacity;
+    q->head     = 0;
+    q->count    = 0;
+    q->closed   = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notempty, NULL);
+    pthread_cond_init(&q->notfull, NULL);
+
+    return q;
+}
+
+/* nobody may be waiting on q any more */
+void
+queuefree(Queue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notempty);
+    pthread_cond_destroy(&q->notfull);
+    free(q->items);
+    free(q);
+}
+
+void
+queuepush(Queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->notfull, &q->lock);
+    q->items[(q->head + q->count++) % q->capacity] = item;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* queuepush() unless q is full, in which case it returns false */
+bool
+queuetrypush(Queue *q, void *item) {
+    bool pushed = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count < q->capacity) {
+        q->items[(q->head + q->count++) % q->capacity] = item;
+        pthread_cond_signal(&q->notempty);
+        pushed = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return pushed;
+}
+
+/* Returns NULL once q is closed and everything pushed has been popped */
+void *
+queuepop(Queue *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->count && !q->closed)
+        pthread_cond_wait(&q->notempty, &q->lock);
+    if (q->count) {
+        item    = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->notfull);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+/* no more pushes; those waiting to pop are woken */
+void
+queueclose(Queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,11 @@
+typedef struct Queue Queue;
+
+/* A bounded first in, first out queue handing pointers from the threads of
+ * one stage of a pipeline to those of the next. Pushing blocks while it's
+ * full, and popping while it's empty, until it's closed */
+Queue *queueinit(size_t capacity);
+void  queuefree(Queue *q);
+void  queuepush(Queue *q, void *item);
+bool  queuetrypush(Queue *q, void *item);
+void  *queuepop(Queue *q);
+void  queueclose(Queue *q);
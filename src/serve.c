@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "queue.h"
+#include "serve.h"
+#include "util.h"
+
+#define MAX_REQUEST     65536
+#define REQUEST_FDS     4  /* stdin, stdout, stderr and working directory */
+#define RECEIVE_TIMEOUT 5  /* seconds a client has to send its request in */
+#define PREPARE_QUEUE   64 /* requests waiting for prepare(); others skip it */
+
+/* a command line, and the working directory it's run in */
+typedef struct {
+    int      dir;
+    uint32_t len;
+    char     *buf;
+} Request;
+
+/* a connection whose request is still coming in */
+typedef struct {
+    int      conn;
+    int      fds[REQUEST_FDS]; /* fds[0] is -1 until they come */
+    uint32_t have;             /* bytes received, of r.len and then of r.buf */
+    time_t   deadline;
+    Request  r;
+} Pending;
+
+/* a request being run, and the connection its status goes back on */
+typedef struct {
+    pid_t   pid;
+    int     conn;
+    Request r;
+} Child;
+
+/* what the thread running prepare() is given */
+typedef struct {
+    Queue *requests;
+    void  (*prepare)(int, char **);
+} Preparer;
+
+/* A request is a native endian uint32_t with the length of the command line
+ * that follows, as NUL terminated arguments, sent along with the REQUEST_FDS
+ * descriptors of the client through SCM_RIGHTS. The reply is the exit status
+ * of the command, as a native endian int32_t */
+
+static void unixaddress(struct sockaddr_un *addr, const char *path);
+static int  listenon(const char *path);
+static int  receive(Pending *p);
+static void drop(Pending *p);
+static char **splitargs(const Request *r, int *argc);
+static void *preparing(void *arg);
+static void handoff(Queue *requests, const Request *r);
+static pid_t start(const Request *r, const int fds[3], int (*request)(int, char **), const sigset_t *mask);
+static void reap(Child *children, size_t *nchildren, Queue *requests);
+static time_t now(void);
+
+void
+unixaddress(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        die("%s: socket path too long\n", path);
+    strcpy(addr->sun_path, path);
+}
+
+int
+listenon(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (s < 0)
+        die("socket: %s\n", strerror(errno));
+    unixaddress(&addr, path);
+    /* a socket left behind by a server that's gone */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)
+            && connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno == ECONNREFUSED)
+        unlink(path);
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) || listen(s, SOMAXCONN))
+        die("%s: %s\n", path, strerror(errno));
+
+    return s;
+}
+
+/* Takes in what's arrived of the request of p, without waiting for more.
+ * Returns 1 once it's all there and well formed, 0 while there's more to
+ * come, and -1 if it's anything else or the client's gone */
+int
+receive(Pending *p) {
+    union {
+        char           buf[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    for (;;) {
+        bool header = p->have < sizeof(p->r.len);
+        struct iovec iov =
+            { .iov_base = header ? (char *) &p->r.len + p->have : p->r.buf + (p->have - sizeof(p->r.len))
+            , .iov_len  = header ? sizeof(p->r.len) - p->have : sizeof(p->r.len) + p->r.len - p->have
+            };
+        struct msghdr msg =
+            { .msg_iov        = &iov
+            , .msg_iovlen     = 1
+            , .msg_control    = control.buf
+            , .msg_controllen = sizeof(control.buf)
+            };
+        struct cmsghdr *c;
+        size_t nfds = 0;
+
+        ssize_t r = recvmsg(p->conn, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (r < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            int *fds = (int *) CMSG_DATA(c);
+            nfds     = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nfds == REQUEST_FDS && p->fds[0] < 0) {
+                memcpy(p->fds, fds, sizeof(p->fds));
+            } else {
+                for (size_t i = 0; i < nfds; i++)
+                    close(fds[i]);
+                return -1;
+            }
+        }
+        if (r == 0 || (msg.msg_flags & MSG_CTRUNC))
+            return -1;
+
+        p->have += r;
+        if (p->have == sizeof(p->r.len)) {
+            if (!p->r.len || p->r.len > MAX_REQUEST || !(p->r.buf = malloc(p->r.len)))
+                return -1;
+        } else if (p->have == sizeof(p->r.len) + p->r.len) {
+            return p->fds[0] >= 0 && !p->r.buf[p->r.len - 1] ? 1 : -1;
+        }
+    }
+}
+
+/* Closes a connection whose request won't be run, and all that came with it */
+void
+drop(Pending *p) {
+    for (size_t i = 0; i < REQUEST_FDS && p->fds[0] >= 0; i++)
+        close(p->fds[i]);
+    free(p->r.buf);
+    close(p->conn);
+}
+
+/* The arguments in the buffer of r, in a NULL terminated array of their own,
+ * or NULL if there's no memory for it */
+char **
+splitargs(const Request *r, int *argc) {
+    char **argv = malloc(sizeof(*argv) * (r->len + 1UL));
+
+    if (!argv)
+        return NULL;
+    *argc = 0;
+    for (char *p = r->buf; p < r->buf + r->len; p += strlen(p) + 1)
+        argv[(*argc)++] = p;
+    argv[*argc] = NULL;
+
+    return argv;
+}
+
+/* Runs prepare() for each request handed off, in its working directory. It's
+ * the only thread of the server that uses one, so it can just change to it */
+void *
+preparing(void *arg) {
+    Preparer *p = arg;
+    Request *r;
+    char **argv;
+    int argc;
+
+    while ((r = queuepop(p->requests))) {
+        if (!fchdir(r->dir) && (argv = splitargs(r, &argc))) {
+            p->prepare(argc, argv);
+            free(argv);
+        }
+        close(r->dir);
+        free(r->buf);
+        free(r);
+    }
+
+    return NULL;
+}
+
+/* Queues a copy of r for prepare(), unless too many are waiting already, as
+ * nothing depends on it but how soon later requests are */
+void
+handoff(Queue *requests, const Request *r) {
+    Request *copy = malloc(sizeof(*copy));
+
+    if (!copy)
+        return;
+    copy->len = r->len;
+    copy->buf = malloc(r->len);
+    copy->dir = fcntl(r->dir, F_DUPFD_CLOEXEC, 0);
+    if (copy->buf && copy->dir >= 0) {
+        memcpy(copy->buf, r->buf, r->len);
+        if (queuetrypush(requests, copy))
+            return;
+    }
+    if (copy->dir >= 0)
+        close(copy->dir);
+    free(copy->buf);
+    free(copy);
+}
+
+/* Starts r in a child with the signal mask of before serve(), and fds as its
+ * stdin, stdout and stderr, returning its pid, or -1 if it couldn't. The
+ * child keeps no other descriptor of the server */
+pid_t
+start(const Request *r, const int fds[3], int (*request)(int, char **), const sigset_t *mask) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        char **argv;
+        int argc;
+
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        if (fchdir(r->dir))
+            _exit(EXIT_FAILURE);
+        for (int i = 0; i < 3; i++)
+            if (dup2(fds[i], i) < 0)
+                _exit(EXIT_FAILURE);
+        close_range(3, ~0U, 0);
+        if (!(argv = splitargs(r, &argc)))
+            _exit(EXIT_FAILURE);
+        exit(request(argc, argv));
+    }
+
+    return pid;
+}
+
+/* Sends the exit status of every child that's done back to its client, and
+ * has its request prepared again, as it may have changed what it looked at */
+void
+reap(Child *children, size_t *nchildren, Queue *requests) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (size_t i = 0; i < *nchildren; i++) {
+            Child *c = &children[i];
+            if (c->pid != pid)
+                continue;
+            int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            writeall(c->conn, &code, sizeof(code));
+            close(c->conn);
+            handoff(requests, &c->r);
+            close(c->r.dir);
+            free(c->r.buf);
+            *c = children[--*nchildren];
+            break;
+        }
+    }
+}
+
+time_t
+now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec;
+}
+
+/* Nothing in the loop waits on a client or on the disk: requests come in on
+ * connections polled with the rest, are started as soon as they're whole, and
+ * handed to a thread of their own for prepare(). A finished child is noticed
+ * through a signalfd, and only then is its status sent back */
+void
+serve(const char *path, void (*prepare)(int argc, char *argv[]), int (*request)(int argc, char *argv[])) {
+    size_t nchildren = 0, npending = 0;
+    size_t childcap  = 16, pendingcap = 16;
+    Child *children  = xmalloc(sizeof(*children) * childcap);
+    Pending *pending = xmalloc(sizeof(*pending) * pendingcap);
+    struct pollfd *p = xmalloc(sizeof(*p) * (2 + pendingcap));
+    Preparer preparer = { queueinit(PREPARE_QUEUE), prepare };
+    pthread_t thread;
+    sigset_t chld, mask;
+    int listener, sfd;
+
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &mask);
+    if ((sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        die("signalfd: %s\n", strerror(errno));
+    listener = listenon(path);
+    if (pthread_create(&thread, NULL, preparing, &preparer))
+        die("pthread_create: couldn't start the thread preparing requests\n");
+
+    for (;;) {
+        struct signalfd_siginfo si;
+
+        p[0] = (struct pollfd) { .fd = listener, .events = POLLIN };
+        p[1] = (struct pollfd) { .fd = sfd, .events = POLLIN };
+        for (size_t i = 0; i < npending; i++)
+            p[2 + i] = (struct pollfd) { .fd = pending[i].conn, .events = POLLIN };
+        if (poll(p, 2 + npending, npending ? 1000 : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll: %s\n", strerror(errno));
+        }
+        if (p[1].revents & POLLIN) {
+            while (read(sfd, &si, sizeof(si)) == sizeof(si))
+                ;
+            reap(children, &nchildren, preparer.requests);
+        }
+
+        /* backwards, as a finished one is replaced by the last */
+        for (size_t i = npending; i-- > 0;) {
+            Pending *c = &pending[i];
+            int got    = p[2 + i].revents ? receive(c) : 0;
+
+            if (got == 0 && now() < c->deadline)
+                continue;
+            if (got <= 0) {
+                drop(c);
+                *c = pending[--npending];
+                continue;
+            }
+
+            c->r.dir  = c->fds[3];
+            pid_t pid = start(&c->r, c->fds, request, &mask);
+            for (size_t j = 0; j < 3; j++)
+                close(c->fds[j]);
+            if (pid < 0) {
+                int32_t status = EXIT_FAILURE;
+                writeall(c->conn, &status, sizeof(status));
+                close(c->conn);
+                close(c->r.dir);
+                free(c->r.buf);
+            } else {
+                if (nchildren == childcap) {
+                    Child *grown = realloc(children, sizeof(*grown) * 2 * childcap);
+                    if (!grown)
+                        die("realloc: couldn't track %zu requests\n", 2 * childcap);
+                    children  = grown;
+                    childcap *= 2;
+                }
+                children[nchildren++] = (Child) { .pid = pid, .conn = c->conn, .r = c->r };
+                handoff(preparer.requests, &c->r);
+            }
+            *c = pending[--npending];
+        }
+
+        if (!(p[0].revents & POLLIN))
+            continue;
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            die("accept: %s\n", strerror(errno));
+        }
+        if (npending == pendingcap) {
+            Pending *grown       = realloc(pending, sizeof(*grown) * 2 * pendingcap);
+            struct pollfd *moved = realloc(p, sizeof(*moved) * (2 + 2 * pendingcap));
+            if (!grown || !moved)
+                die("realloc: couldn't track %zu connections\n", 2 * pendingcap);
+            pending     = grown;
+            p           = moved;
+            pendingcap *= 2;
+        }
+        pending[npending++] = (Pending)
+            { .conn     = conn
+            , .fds      = { -1, -1, -1, -1 }
+            , .deadline = now() + RECEIVE_TIMEOUT
+            , .r        = { .dir = -1 }
+            };
+    }
+}
+
+/* Has the server at path run argv as if it were this process, returning its
+ * exit status */
+int
+connectserver(const char *path, int argc, char *argv[]) {
+    union {
+        char           buf[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct sockaddr_un addr;
+    uint32_t len = 0;
+    int32_t status;
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int fds[REQUEST_FDS] = { 0, 1, 2, open(".", O_PATH | O_DIRECTORY | O_CLOEXEC) };
+
+    if (s < 0 || fds[3] < 0)
+        die("connect: %s\n", strerror(errno));
+    unixaddress(&addr, path);
+    if (connect(s, (struct sockaddr *) &addr, sizeof(addr)))
+        die("%s: %s\n", path, strerror(errno));
+
+    for (int i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (len > MAX_REQUEST)
+        die("command line too long for the server\n");
+
+    char *buf = xmalloc(len);
+    for (int i = 0, n = 0; i < argc; i++)
+        n += strlen(strcpy(buf + n, argv[i])) + 1;
+
+    struct iovec iov = { .iov_base = &len, .iov_len = sizeof(len) };
+    struct msghdr msg =
+        { .msg_iov        = &iov
+        , .msg_iovlen     = 1
+        , .msg_control    = control.buf
+        , .msg_controllen = sizeof(control.buf)
+        };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if (sendmsg(s, &msg, 0) != sizeof(len) || !writeall(s, buf, len))
+        die("%s: couldn't send the request\n", path);
+    if (!readall(s, &status, sizeof(status)))
+        die("%s: the server went away\n", path);
+    free(buf);
+    close(fds[3]);
+    close(s);
+
+    return status;
+}
@@ -0,0 +1,9 @@
+/* A local server running command lines on behalf of clients. Each request is
+ * run by request() in a child forked off the server, with the stdin, stdout,
+ * stderr and working directory of the client, so it can die() freely and
+ * whatever prepare() left in memory is already there. prepare() is given each
+ * request too, on a thread of its own in the client's working directory, both
+ * as it starts and once it's done; requests don't wait for it. So it mustn't
+ * die(), and what it changes must be locked across fork() (pthread_atfork) */
+void serve(const char *path, void (*prepare)(int argc, char *argv[]), int (*request)(int argc, char *argv[]));
+int  connectserver(const char *path, int argc, char *argv[]);
@@ -1,14 +1,38 @@
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(NO_HUGE_PAGES)
+#include <sys/mman.h>
+#if defined(MAP_HUGETLB) && defined(MAP_FIXED_NOREPLACE) && defined(MADV_HUGEPAGE)
+#define HAVE_HUGE_PAGES
+#endif
+#endif
 
 #include "util.h"
 
+#define HUGE_PAGE    (2UL << 20)
+#define PIXEL_HEADER 64 /* least room kept before pixels, a cache line */
+
+/* what xpixelalloc() keeps right before the pixels, to free them by */
+typedef struct {
+    void   *base;   /* start of the allocation, or of the page before a mapping */
+    size_t maplen;  /* length of the pixels' mapping, or 0 if from malloc */
+} Pixelblock;
+
+#ifdef HAVE_HUGE_PAGES
+static void *mapbig(size_t len);
+#endif
+
 void
 die(const char *errstr, ...) {
     va_list ap;
@@ -81,6 +105,250 @@ xmalloc(size_t size) {
     return p;
 }
 
+#ifdef HAVE_HUGE_PAGES
+/* A mapping of len bytes, a multiple of HUGE_PAGE, aligned to HUGE_PAGE and
+ * preceded by one ordinary page of its own for the Pixelblock, so recording
+ * it doesn't fault in the first huge page. The len bytes come from the huge
+ * pages reserved by the system if there are enough, or else are marked so
+ * the kernel backs them with transparent huge pages. Nothing is mapped over
+ * a range it doesn't own, as other threads may be mapping too. NULL if
+ * neither can be had */
+void *
+mapbig(size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t span = page + len + HUGE_PAGE;
+    int prot    = PROT_READ | PROT_WRITE;
+    int flags   = MAP_PRIVATE | MAP_ANONYMOUS;
+    int hflags  = MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+    hflags |= MAP_HUGE_2MB;
+#endif
+    /* huge page mappings come aligned; the page before must be free */
+    uint8_t *m = mmap(NULL, len, prot, flags | hflags, -1, 0);
+
+    if (m != MAP_FAILED) {
+        uint8_t *h = mmap(m - page, page, prot, flags | MAP_FIXED_NOREPLACE, -1, 0);
+        if (h == m - page)
+            return m;
+        if (h != MAP_FAILED) /* kernels before 4.17 take it as a hint */
+            munmap(h, page);
+        munmap(m, len);
+    }
+
+    /* reserve room to pick an aligned start with a page before it */
+    if ((m = mmap(NULL, span, PROT_NONE, flags, -1, 0)) == MAP_FAILED)
+        return NULL;
+    uint8_t *base = m + page;
+    base += (HUGE_PAGE - (uintptr_t) base % HUGE_PAGE) % HUGE_PAGE;
+    if (base - page > m)
+        munmap(m, base - page - m);
+    if (base + len < m + span)
+        munmap(base + len, m + span - (base + len));
+    if (mprotect(base - page, page + len, prot)) {
+        munmap(base - page, page + len);
+        return NULL;
+    }
+    madvise(base, len, MADV_HUGEPAGE);
+
+    return base;
+}
+#endif
+
+/* Allocates size bytes for pixels, aligned to alignment (a power of two, or 0
+ * for no particular one). Arrays of a huge page or more get a mapping of their
+ * own on huge pages, so walking a large image takes a handful of TLB entries
+ * rather than thousands, falling back to malloc() where there are none. The
+ * huge pages aren't written to, so on NUMA systems each one ends up on the
+ * node of the thread that fills it first. Free them with pixelfree() */
+void *
+xpixelalloc(size_t size, size_t alignment) {
+    size_t header = alignment > PIXEL_HEADER ? alignment : PIXEL_HEADER;
+    void *base    = NULL;
+    size_t maplen = 0;
+    uint8_t *p    = NULL;
+
+#ifdef HAVE_HUGE_PAGES
+    if (size >= HUGE_PAGE && alignment <= HUGE_PAGE) {
+        maplen = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        if ((p = mapbig(maplen)))
+            base = p - sysconf(_SC_PAGESIZE);
+    }
+#endif
+    if (!p) {
+        maplen = 0;
+        if (posix_memalign(&base, header, header + size))
+            die("xpixelalloc: couldn't allocate %zu bytes\n", size);
+        p = (uint8_t *) base + header;
+    }
+
+    memcpy(p - sizeof(Pixelblock), &(Pixelblock) { base, maplen }, sizeof(Pixelblock));
+
+    return p;
+}
+
+void
+pixelfree(void *p) {
+    Pixelblock b;
+
+    if (!p)
+        return;
+    memcpy(&b, (uint8_t *) p - sizeof(b), sizeof(b));
+#ifdef HAVE_HUGE_PAGES
+    if (b.maplen) {
+        /* apart, as the pixels may be on huge pages and the header isn't */
+        munmap(b.base, (uint8_t *) p - (uint8_t *) b.base);
+        munmap(p, b.maplen);
+        return;
+    }
+#endif
+    free(b.base);
+}
+
+/* read(2) until count bytes were read. Returns false on error or EOF */
+bool
+readall(int fd, void *buf, size_t count) {
+    char *p = buf;
+
+    while (count > 0) {
+        ssize_t r = read(fd, p, count);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        count -= r;
+    }
+
+    return true;
+}
+
+/* write(2) until count bytes were written. Returns false on error */
+bool
+writeall(int fd, const void *buf, size_t count) {
+    const char *p = buf;
+
+    while (count > 0) {
+        ssize_t w = write(fd, p, count);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return false;
+        p += w;
+        count -= w;
+    }
+
+    return true;
+}
+
+/* pread(2) until count bytes were read, dying on error or EOF */
+void
+xpread(int fd, void *buf, size_t count, off_t offset) {
+    char *p = buf;
+
+    while (count > 0) {
+        ssize_t r = pread(fd, p, count, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            die("pread: error or unexpected end of file\n");
+        p += r;
+        offset += r;
+        count -= r;
+    }
+}
+
+/* Reads a whole file into memory, in a buffer from xpixelalloc(). If alignment
+ * is not 0, the buffer is aligned to it and, when the file size is a multiple
+ * of it, O_DIRECT is tried first. Filesystems without O_DIRECT support
+ * silently get a buffered read */
+void *
+xreadfile(const char *filename, size_t *size, size_t alignment) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        die("open: couldn't open %s\n", filename);
+    if (fstat(fd, &st))
+        die("fstat: error on %s\n", filename);
+    if (st.st_size <= 0)
+        die("%s: empty file\n", filename);
+
+    *size = st.st_size;
+    void *buf = xpixelalloc(*size, alignment);
+
+    if (alignment && *size % alignment == 0) {
+        int dfd = open(filename, O_RDONLY | O_DIRECT);
+        if (dfd >= 0) {
+            bool ok = readall(dfd, buf, *size);
+            close(dfd);
+            if (ok) {
+                close(fd);
+                return buf;
+            }
+        }
+    }
+    if (!readall(fd, buf, *size))
+        die("read: error reading %s\n", filename);
+    close(fd);
+
+    return buf;
+}
+
+/* Creates a file to be renamed over filename once fully written, so that
+ * nobody ever sees it half done. It lives in the same directory, under a name
+ * unique across processes and threads, which is copied to tmpname */
+int
+opentemp(const char *filename, char *tmpname, size_t size, int flags) {
+    static unsigned long seq;
+    const char *slash = strrchr(filename, '/');
+    int dirlen        = slash ? slash - filename + 1 : 0;
+
+    xsnprintf(tmpname, size, "%.*s.%s.%ld.%lu.tmp", dirlen, filename,
+            filename + dirlen, (long) getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+
+    return open(tmpname, O_WRONLY | O_CREAT | O_EXCL | flags, 0666);
+}
+
+void
+xrename(const char *oldpath, const char *newpath) {
+    if (rename(oldpath, newpath))
+        die("rename: couldn't rename %s to %s\n", oldpath, newpath);
+}
+
+/* Atomically replaces filename with size bytes of buf. With direct, buf and
+ * size must be suitably aligned; O_DIRECT is then tried first, falling back to
+ * a buffered write where it isn't supported */
+void
+xwritefile(const char *filename, const void *buf, size_t size, bool direct) {
+    char tmpname[PATH_MAX];
+    int fd;
+
+    if (direct && (fd = opentemp(filename, tmpname, sizeof(tmpname), O_DIRECT)) >= 0) {
+        bool ok = writeall(fd, buf, size);
+        if (close(fd) == 0 && ok) {
+            xrename(tmpname, filename);
+            return;
+        }
+        unlink(tmpname);
+    }
+    if ((fd = opentemp(filename, tmpname, sizeof(tmpname), 0)) < 0)
+        die("open: couldn't create a file next to %s\n", filename);
+    if (!writeall(fd, buf, size)) {
+        unlink(tmpname);
+        die("write: error writing %s\n", filename);
+    }
+    if (close(fd))
+        die("close: error on %s\n", tmpname);
+    xrename(tmpname, filename);
+}
+
+char *
+xstrdup(const char *s) {
+    size_t len = strlen(s) + 1;
+
+    return memcpy(xmalloc(len), s, len);
+}
+
 size_t
 xsnprintf(char *str, size_t size, const char *fmt, ...) {
     va_list ap;
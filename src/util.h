@@ -7,6 +7,16 @@ void     xfseek(FILE *fp, long offset, int whence);
 DIR      *xopendir(const char *name);
 void     xclosedir(DIR *dirp);
 void     *xmalloc(size_t size);
+void     *xpixelalloc(size_t size, size_t alignment);
+void     pixelfree(void *p);
+bool     readall(int fd, void *buf, size_t count);
+bool     writeall(int fd, const void *buf, size_t count);
+void     xpread(int fd, void *buf, size_t count, off_t offset);
+void     *xreadfile(const char *filename, size_t *size, size_t alignment);
+int      opentemp(const char *filename, char *tmpname, size_t size, int flags);
+void     xrename(const char *oldpath, const char *newpath);
+void     xwritefile(const char *filename, const void *buf, size_t size, bool direct);
+char     *xstrdup(const char *s);
 size_t   xsnprintf(char *str, size_t size, const char *fmt, ...);
 long int xstrtol(const char *nptr, char **end, int base);
 